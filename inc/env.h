@@ -46,14 +46,27 @@ enum EnvType {
     ENV_TYPE_USER,
 };
 
-struct List {
-    struct List *prev, *next;
+/* Physical memory allocation policies for NUMA systems */
+enum NumaPolicy {
+    NUMA_LOCAL,      /* Node of the current CPU first */
+    NUMA_INTERLEAVE, /* Round-robin over all nodes */
+    NUMA_POLICY_COUNT,
 };
 
 struct AddressSpace {
-    pml4e_t *pml4;     /* Virtual address of pml4 */
-    uintptr_t cr3;     /* Physical address of pml4 */
-    struct Page *root; /* root node of address space tree */
+    pml4e_t *pml4;           /* Virtual address of pml4 */
+    uintptr_t cr3;           /* Physical address of pml4 */
+    struct Page *root;       /* root node of address space tree */
+    struct VirtualDir *vdir; /* Top directory of virtual tree radix index */
+    uintptr_t vdir_base;     /* Base address of range covered by vdir */
+    uint8_t vdir_level;      /* Radix index level of vdir */
+    uint8_t numa_policy;     /* enum NumaPolicy */
+    uint8_t numa_next;       /* Next node for NUMA_INTERLEAVE */
+    uint8_t promote_pending; /* Small pages were faulted in since last promotion pass */
+    uint8_t fault_around;    /* Log2 of fault-around window in pages */
+    uint8_t light;           /* Mappings are stored only in page tables */
+    uint16_t pcid;           /* Process-context identifier tagging TLB entries */
+    uint64_t pcid_gen;       /* Generation pcid belongs to (0 if none) */
 };
 
 
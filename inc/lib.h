@@ -88,6 +88,11 @@ int sys_map_region(envid_t src_env, void *src_pg,
 int sys_unmap_region(envid_t env, void *pg, size_t size);
 int sys_ipc_try_send(envid_t to_env, uint64_t value, void *pg, size_t size, int perm);
 int sys_ipc_recv(void *rcv_pg, size_t size);
+int sys_set_mempolicy(envid_t env, int policy);
+int sys_set_fault_around(envid_t env, int order);
+int sys_set_space_light(envid_t env, bool light);
+envid_t sys_fork(void);
+envid_t sys_spawn(const char *name, const char **argv);
 
 /* This must be inlined. Exercise for reader: why? */
 static inline envid_t __attribute__((always_inline))
@@ -106,6 +111,7 @@ envid_t ipc_find_env(enum EnvType type);
 
 /* fork.c */
 envid_t fork(void);
+envid_t lfork(void);
 envid_t sfork(void);
 
 /* uvpt.c */
@@ -97,11 +97,15 @@
  * hardware, so user processes are allowed to set them arbitrarily */
 #define PTE_AVAIL 0xE00 /* Available for software use */
 
+/* High bits are ignored by hardware while protection keys are disabled
+ * and are used by the kernel to describe metadata-light mappings */
+#define PTE_IGNORED (0x7FFULL << 52)
+
 /* Flags in PTE_SYSCALL may be used in system calls  (Others may not) */
 #define PTE_SYSCALL (PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
 /* Address in page table or page directory entry */
-#define PTE_ADDR(pte) ((physaddr_t)(pte) & ~(PTE_NX | (PAGE_SIZE - 1)))
+#define PTE_ADDR(pte) ((physaddr_t)(pte) & ~(PTE_NX | PTE_IGNORED | (PAGE_SIZE - 1)))
 
 
 /* Control Register flags */
@@ -117,6 +121,10 @@
 #define CR0_CD 0x40000000 /* Cache Disable */
 #define CR0_PG 0x80000000 /* Paging */
 
+#define CR3_PCID_MASK 0xFFFULL     /* Process-context identifier */
+#define CR3_NOFLUSH   (1ULL << 63) /* Preserve TLB entries of loaded PCID */
+#define MAX_PCID      4096
+
 #define CR4_VME        0x00000001 /* V86 Mode Extensions */
 #define CR4_PVI        0x00000002 /* Protected-Mode Virtual Interrupts */
 #define CR4_TSD        0x00000004 /* Time Stamp Disable */
@@ -145,6 +153,10 @@
 #define EFER_LMA (1ULL << 10)
 #define EFER_NXE (1ULL << 11)
 
+/* CPUID leaf 1 feature bits */
+#define CPUID_PCID (1U << 17) /* ECX: Process-context identifiers */
+#define CPUID_PGE  (1U << 13) /* EDX: Page global enable */
+
 /* RFLAGS register */
 #define FL_CF        0x00000001 /* Carry Flag */
 #define FL_PF        0x00000004 /* Parity Flag */
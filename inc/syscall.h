@@ -18,6 +18,11 @@ enum {
     SYS_yield,
     SYS_ipc_try_send,
     SYS_ipc_recv,
+    SYS_set_mempolicy,
+    SYS_set_fault_around,
+    SYS_set_space_light,
+    SYS_fork,
+    SYS_spawn,
     NSYSCALLS
 };
 
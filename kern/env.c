@@ -16,6 +16,7 @@
 #include <kern/macro.h>
 #include <kern/pmap.h>
 #include <kern/traceopt.h>
+#include <kern/uaccess.h>
 
 /* Currently active environment */
 struct Env *curenv = NULL;
@@ -251,6 +252,84 @@ bind_functions(struct Env *env, uint8_t *binary, size_t size, uintptr_t image_st
     return 0;
 }
 
+/* Loads program segment of binary described by ph to space
+ * with protection prot */
+static int
+load_segment(struct AddressSpace *spc, uint8_t *binary, struct Proghdr *ph, int prot) {
+    extern char __binary_start[], __binary_end[];
+
+    void *src = binary + ph->p_offset;
+    void *dst = (void *)(ph->p_va);
+    uintptr_t start = ROUNDDOWN((uintptr_t)dst, PAGE_SIZE);
+    uintptr_t end = ROUNDUP((uintptr_t)dst + ph->p_memsz, PAGE_SIZE);
+    uintptr_t file_end = (uintptr_t)dst + ph->p_filesz;
+
+    /* Whole pages of file contents are mapped lazily right from the image
+     * when it is one of embedded images and is aligned the same way.
+     * Other pages with file contents are copied and the rest
+     * is lazily zero-filled */
+    uintptr_t direct = ROUNDUP((uintptr_t)dst, PAGE_SIZE);
+    uintptr_t direct_end = ROUNDDOWN(file_end, PAGE_SIZE);
+    if (binary < (uint8_t *)__binary_start || (uint8_t *)src + ph->p_filesz > (uint8_t *)__binary_end ||
+        ((uintptr_t)dst ^ (uintptr_t)src) & CLASS_MASK(0) || direct >= direct_end)
+        direct = direct_end = file_end;
+    uintptr_t copy_end = ph->p_filesz ? ROUNDUP(file_end, PAGE_SIZE) : start;
+
+    int res = map_kernel_copy(spc, (uintptr_t)dst, src, direct - (uintptr_t)dst, prot);
+    if (!res && direct_end > direct)
+        res = map_kernel_lazy(spc, direct, src + (direct - (uintptr_t)dst), direct_end - direct, prot);
+    if (!res && file_end > direct_end)
+        res = map_kernel_copy(spc, direct_end, src + (direct_end - (uintptr_t)dst), file_end - direct_end, prot);
+    if (!res && end > copy_end)
+        res = map_region(spc, copy_end, NULL, 0, end - copy_end, prot | ALLOC_ZERO);
+    return res;
+}
+
+/* Read-only segments of program images are loaded once to the address
+ * space of image cache entry and mapped from there to every environment
+ * running the image, so their pages are shared by all of them.
+ * Entries are never released, since images are never unloaded */
+#define IMAGE_CACHE_SIZE 64
+
+static struct ImageCache {
+    uint8_t *binary;
+    uint64_t loaded; /* Bitmask of loaded program headers */
+    struct AddressSpace space;
+} image_cache[IMAGE_CACHE_SIZE];
+
+/* Maps read-only segment of binary described by program header
+ * with given index from image cache to env, loading it if required */
+static int
+map_cached_segment(struct Env *env, uint8_t *binary, size_t index) {
+    struct Elf *elf = (struct Elf *)binary;
+    struct Proghdr *ph = (struct Proghdr *)(binary + elf->e_phoff) + index;
+    int prot = PROT_R | PROT_USER_ | (ph->p_flags & ELF_PROG_FLAG_EXEC ? PROT_X : 0);
+
+    struct ImageCache *cache = NULL;
+    for (size_t i = 0; i < IMAGE_CACHE_SIZE && !cache; i++)
+        if (image_cache[i].binary == binary || !image_cache[i].binary) cache = &image_cache[i];
+
+    /* Segments are loaded privately if cache is full */
+    if (!cache || index >= sizeof(cache->loaded) * 8)
+        return load_segment(&env->address_space, binary, ph, prot);
+
+    if (!cache->binary) {
+        int res = init_address_space(&cache->space);
+        if (res < 0) return res;
+        cache->binary = binary;
+    }
+
+    if (!(cache->loaded & (1ULL << index))) {
+        int res = load_segment(&cache->space, binary, ph, prot);
+        if (res < 0) return res;
+        cache->loaded |= 1ULL << index;
+    }
+
+    uintptr_t start = ROUNDDOWN(ph->p_va, PAGE_SIZE);
+    uintptr_t end = ROUNDUP(ph->p_va + ph->p_memsz, PAGE_SIZE);
+    return map_region(&env->address_space, start, &cache->space, start, end - start, prot | PROT_LAZY);
+}
+
 /* Set up the initial program binary, stack, and processor flags
  * for a user process.
  * This function is ONLY called during kernel initialization,
@@ -328,7 +407,6 @@ load_icode(struct Env *env, uint8_t *binary, size_t size) {
     bool start_set = 0;
     uintptr_t image_end = 0;
 #endif
-    switch_address_space(&env->address_space);
     struct Proghdr *ph_array = (struct Proghdr *)(binary + elf->e_phoff);
     for (size_t i = 0; i < elf->e_phnum; i++) {
         struct Proghdr *ph = ph_array + i;
@@ -336,7 +414,6 @@ load_icode(struct Env *env, uint8_t *binary, size_t size) {
             continue;
 
         void *src = binary + ph->p_offset;
-        void *dst = (void *)(ph->p_va);
 
         if (ph->p_filesz > ph->p_memsz) {
             cprintf("Incorrect filesz of a section");
@@ -347,6 +424,7 @@ load_icode(struct Env *env, uint8_t *binary, size_t size) {
             continue;
 
 #ifdef CONFIG_KSPACE
+        void *dst = (void *)(ph->p_va);
         if (!start_set || (uintptr_t) dst < image_start) {
             image_start = (uintptr_t) dst;
             start_set = 1;
@@ -354,22 +432,24 @@ load_icode(struct Env *env, uint8_t *binary, size_t size) {
         if (image_end < (uintptr_t)(dst + ph->p_memsz))
             image_end = (uintptr_t)(dst + ph->p_memsz);
 #endif
-        map_region(&env->address_space, ROUNDDOWN((uintptr_t) dst, PAGE_SIZE),
-            NULL, 0, ROUNDUP((uintptr_t)ph->p_memsz, PAGE_SIZE), PROT_RWX | PROT_USER_ | ALLOC_ZERO);
-
-        memcpy(dst, src, ph->p_filesz);
-        memset(dst + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+        int res;
+        if (!(ph->p_flags & ELF_PROG_FLAG_WRITE))
+            res = map_cached_segment(env, binary, i);
+        else
+            res = load_segment(&env->address_space, binary, ph, PROT_RWX | PROT_USER_);
+        if (res < 0)
+            return res;
     }
 
     map_region(&env->address_space, USER_STACK_TOP - USER_STACK_SIZE,
         NULL, 0, USER_STACK_SIZE, PROT_R | PROT_W | PROT_USER_ | ALLOC_ZERO);
 
-    switch_address_space(&env->address_space);
-
     env->env_tf.tf_rip = elf->e_entry;
 
 #ifdef CONFIG_KSPACE
+    struct AddressSpace *old = switch_address_space(&env->address_space);
     bind_functions(env, binary, size, image_start, image_end);
+    switch_address_space(old);
 #endif
     return 0;
 }
@@ -397,6 +477,85 @@ env_create(uint8_t *binary, size_t size, enum EnvType type) {
     env->env_type = type;
 }
 
+/* Finds program image embedded into the kernel by its name (e.g. "user/hello").
+ * Images are looked up in kernel symbol table only.
+ * Returns -E_NO_ENT if there is no such image */
+static int
+find_binary(const char *name, uint8_t **binary, size_t *size) {
+    char sym[SPAWN_NAME_MAX + sizeof("_binary_obj__start")];
+    snprintf(sym, sizeof(sym), "_binary_obj_%s_start", name);
+    /* Linker replaces all non-alphanumeric characters of file name */
+    for (char *c = sym; *c; c++)
+        if (!(*c >= 'a' && *c <= 'z') && !(*c >= 'A' && *c <= 'Z') && !(*c >= '0' && *c <= '9')) *c = '_';
+
+    uint8_t *start = (uint8_t *)find_symbol(sym);
+    if (!start) return -E_NO_ENT;
+    strcpy(sym + strlen(sym) - strlen("start"), "end");
+    uint8_t *end = (uint8_t *)find_symbol(sym);
+    if (!end) return -E_NO_ENT;
+
+    *binary = start;
+    *size = end - start;
+    return 0;
+}
+
+/* Places argc NUL-terminated strings stored one after another in args
+ * at the top of env's stack, as lib/entry.S expects program arguments.
+ * Argument vector is built in kernel and copied out with copyout() */
+static int
+push_args(struct Env *env, int argc, const char *args, size_t size) {
+    assert(argc <= SPAWN_ARGC_MAX);
+
+    uintptr_t strings = ROUNDDOWN(USER_STACK_TOP - size, sizeof(uintptr_t));
+    uintptr_t *argv = (uintptr_t *)strings - (argc + 1);
+    uintptr_t *sp = (uintptr_t *)ROUNDDOWN((uintptr_t)(argv - 2), 16);
+    if ((uintptr_t)sp < USER_STACK_TOP - USER_STACK_SIZE) return -E_INVAL;
+
+    uintptr_t kargv[SPAWN_ARGC_MAX + 1];
+    for (int i = 0, offset = 0; i < argc; i++) {
+        kargv[i] = strings + offset;
+        offset += strlen(args + offset) + 1;
+    }
+    kargv[argc] = 0;
+    uintptr_t top[2] = {argc, (uintptr_t)argv};
+
+    struct AddressSpace *old = switch_address_space(&env->address_space);
+    int res = copyout((void *)strings, args, size) ||
+              copyout(argv, kargv, (argc + 1) * sizeof(*kargv)) ||
+              copyout(sp, top, sizeof(top)) ? -E_FAULT : 0;
+    switch_address_space(old);
+    if (res < 0) return res;
+
+    env->env_tf.tf_rsp = (uintptr_t)sp;
+    return 0;
+}
+
+/* Creates child of the current environment running program image
+ * with given name (see find_binary()) with arguments from args,
+ * laid out as in push_args(). Caller address space is not touched. */
+int
+env_spawn(struct Env **penv, const char *name, int argc, const char *args, size_t args_size) {
+    uint8_t *binary;
+    size_t size;
+    int res = find_binary(name, &binary, &size);
+    if (res < 0) return res;
+
+    struct Env *env;
+    if ((res = env_alloc(&env, curenv ? curenv->env_id : 0, ENV_TYPE_USER)) < 0) return res;
+    env->env_status = ENV_NOT_RUNNABLE;
+
+    if ((res = load_icode(env, binary, size)) < 0 ||
+        (res = push_args(env, argc, args, args_size)) < 0) {
+        env_destroy(env);
+        return res;
+    }
+
+    env->binary = binary;
+    env->env_status = ENV_RUNNABLE;
+    *penv = env;
+    return 0;
+}
+
 
 /* Frees env and all memory it uses */
 void
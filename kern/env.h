@@ -7,6 +7,11 @@
 
 #define NCPU 1
 
+/* Limits of sys_spawn() arguments */
+#define SPAWN_NAME_MAX  64
+#define SPAWN_ARGC_MAX  32
+#define SPAWN_ARGS_SIZE 1024
+
 /* All environments */
 extern struct Env *envs;
 /* Currently active environment */
@@ -17,6 +22,7 @@ void env_init(void);
 int env_alloc(struct Env **penv, envid_t parent_id, enum EnvType type);
 void env_free(struct Env *env);
 void env_create(uint8_t *binary, size_t size, enum EnvType type);
+int env_spawn(struct Env **penv, const char *name, int argc, const char *args, size_t args_size);
 void env_destroy(struct Env *env);
 
 int envid2env(envid_t envid, struct Env **env_store, bool checkperm);
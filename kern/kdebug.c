@@ -93,9 +93,7 @@ debuginfo_rip(uintptr_t addr, struct Ripdebuginfo *info) {
     /* Temporarily load kernel cr3 and return back once done.
     * Make sure that you fully understand why it is necessary. */
     // LAB 8: Your code here
-    uintptr_t old_cr3 = curenv->address_space.cr3;
-    if (old_cr3 != kspace.cr3)
-        lcr3(kspace.cr3);
+    struct AddressSpace *old = current_space ? switch_address_space(&kspace) : NULL;
 
     /* Load dwarf section pointers from either
      * currently running program binary or use
@@ -138,33 +136,45 @@ debuginfo_rip(uintptr_t addr, struct Ripdebuginfo *info) {
 
     // LAB 2: Your res here:
     res = function_by_info(&addrs, addr - 5, offset, &tmp_buf, &info->rip_fn_addr);
-    if (res < 0) return 0;;
+    if (res < 0) {
+        res = 0;
+        goto error;
+    }
     strncpy(info->rip_fn_name, tmp_buf, sizeof(info->rip_fn_name));
     info->rip_fn_namelen = strnlen(info->rip_fn_name, sizeof(info->rip_fn_name));
 
 error:
+    if (old) switch_address_space(old);
     return res;
 }
 
+/* Looks name up in kernel symbol table only, returns 0 if it is not there */
 uintptr_t
-find_function(const char *const fname) {
-    /* There are two functions for function name lookup.
-     * address_by_fname, which looks for function name in section .debug_pubnames
-     * and naive_address_by_fname which performs full traversal of DIE tree.
-     * It may also be useful to look to kernel symbol table for symbols defined
-     * in assembly. */
-
-    // LAB 3: Your code here:
+find_symbol(const char *const name) {
     LOADER_PARAMS *lp = (LOADER_PARAMS *)uefi_lp;
     struct Elf64_Sym *symtab = (struct Elf64_Sym *)lp->SymbolTableStart;
     struct Elf64_Sym *symtab_end = (struct Elf64_Sym *)lp->SymbolTableEnd;
     char *strtab = (char *)lp->StringTableStart;
 
     for (struct Elf64_Sym *iter = symtab; iter < symtab_end; iter++) {
-        if (!strcmp(&strtab[iter->st_name], fname)) {
+        if (!strcmp(&strtab[iter->st_name], name)) {
             return (uintptr_t)iter->st_value;
         }
     }
+    return 0;
+}
+
+uintptr_t
+find_function(const char *const fname) {
+    /* There are two functions for function name lookup.
+     * address_by_fname, which looks for function name in section .debug_pubnames
+     * and naive_address_by_fname which performs full traversal of DIE tree.
+     * It may also be useful to look to kernel symbol table for symbols defined
+     * in assembly. */
+
+    // LAB 3: Your code here:
+    uintptr_t addr = find_symbol(fname);
+    if (addr) return addr;
 
     struct Dwarf_Addrs addrs;
     load_kernel_dwarf_info(&addrs);
@@ -24,5 +24,6 @@ struct Ripdebuginfo {
 
 int debuginfo_rip(uintptr_t eip, struct Ripdebuginfo *info);
 uintptr_t find_function(const char *const fname);
+uintptr_t find_symbol(const char *const name);
 
 #endif
@@ -32,6 +32,7 @@ int mon_start(int argc, char **argv, struct Trapframe *tf);
 int mon_stop(int argc, char **argv, struct Trapframe *tf);
 int mon_frequency(int argc, char **argv, struct Trapframe *tf);
 int mon_memory(int argc, char **argv, struct Trapframe *tf);
+int mon_memstat(int argc, char **argv, struct Trapframe *tf);
 int mon_pagetable(int argc, char **argv, struct Trapframe *tf);
 int mon_virt(int argc, char **argv, struct Trapframe *tf);
 
@@ -53,6 +54,7 @@ static struct Command commands[] = {
         {"timer_stop", "Stop timer", mon_stop},
         {"timer_cpu_frequency", "Calculate CPU freq", mon_frequency},
         {"pgs", "Dump free pages", mon_memory},
+        {"memstat", "Display memory metadata statistics", mon_memstat},
 };
 #define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
 
@@ -237,6 +239,12 @@ int mon_memory(int argc, char **argv, struct Trapframe *tf) {
             return 0;
 }
 
+int
+mon_memstat(int argc, char **argv, struct Trapframe *tf) {
+    dump_memory_stats();
+    return 0;
+}
+
 /* Implement mon_pagetable() and mon_virt()
  * (using dump_virtual_tree(), dump_page_table())*/
 // LAB 7: Your code here
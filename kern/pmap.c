@@ -10,6 +10,7 @@
 #include <kern/env.h>
 #include <kern/kclock.h>
 #include <kern/pmap.h>
+#include <kern/timer.h>
 #include <kern/traceopt.h>
 #include <kern/trap.h>
 
@@ -21,13 +22,101 @@
  * by struct Page
  */
 
-/* for O(1) page allocation */
-static struct List free_classes[MAX_CLASS];
+/* Physical memory zones, each one has its own set of free lists
+ * so that zone-constrained allocations do not need to skip
+ * unsuitable pages */
+enum MemoryZone {
+    ZONE_DMA,  /* [0; DMA_MEM_SIZE) */
+    ZONE_BOOT, /* [DMA_MEM_SIZE; BOOT_MEM_SIZE) */
+    ZONE_HIGH, /* [BOOT_MEM_SIZE; max_memory_map_addr) */
+    ZONE_COUNT,
+};
+
+/* Upper bound of ZONE_DMA */
+#define DMA_MEM_SIZE (16 * MB)
+
+static const char *zone_names[ZONE_COUNT] = {"DMA", "Boot", "High"};
+static const physaddr_t zone_limits[ZONE_COUNT] = {DMA_MEM_SIZE, BOOT_MEM_SIZE, ~0ULL};
+
+/* Maximal number of NUMA nodes and of their memory ranges */
+#define MAX_NUMA_NODES  8
+#define MAX_NUMA_RANGES 16
+
+/* Physical memory range of NUMA node (from SRAT) */
+struct NumaRange {
+    physaddr_t start, end;
+    int node;
+};
+
+static struct NumaRange numa_ranges[MAX_NUMA_RANGES];
+static size_t numa_range_count;
+/* Proximity domains of NUMA nodes */
+static uint32_t numa_domains[MAX_NUMA_NODES];
+/* Memory is treated as a single node if there is no SRAT */
+static int numa_node_count = 1;
+/* Node of the boot CPU */
+static int numa_local_node;
+/* Number of pages allocated from each node and
+ * number of allocations that missed preferred node */
+static size_t numa_alloc_count[MAX_NUMA_NODES], numa_miss_count;
+
+/* for O(1) page allocation
+ * (every NUMA node has its own set of zones) */
+static struct List free_classes[MAX_NUMA_NODES][ZONE_COUNT][MAX_CLASS];
+/* Per-CPU caches of standalone 4K pages
+ * (only the first one is used for now) */
+static struct PageMagazine magazines[NCPU];
+#define this_magazine() (&magazines[0])
+/* Caches of pre-zeroed pages filled when CPU is idle */
+static struct ZeroCache zero_caches[MAX_ALLOCATION_CLASS + 1];
+/* Number of pre-zeroed pages kept for each class */
+static const size_t zero_cache_target[MAX_ALLOCATION_CLASS + 1] = {
+        [0] = ZERO_CACHE_SIZE,
+        [MAX_ALLOCATION_CLASS] = 2,
+};
+/* Zeroed allocations served from/past zero caches */
+static size_t zero_cache_hits, zero_cache_misses;
+/* Pages filled with 0x00 and 0xFF used for lazy allocations */
+static struct Page *zero_page, *one_page;
+/* Zeroed page table pages (released empty tables are put here) */
+static struct ZeroCache pt_cache;
+/* Page table allocations served from/past cache and number of reclaimed tables */
+static size_t pt_cache_hits, pt_cache_misses, pt_reclaimed_count;
 /* List of descriptor pools */
 static struct PagePool *first_pool;
-/* List of free descriptors */
-static struct List free_descriptors;
+/* List of pools that have free descriptors */
+static struct List partial_pools;
 static size_t free_desc_count;
+/* Total number of descriptors and peak number of used ones */
+static size_t total_desc_count, peak_desc_count;
+/* Number of descriptor pools, its peak and number of released ones */
+static size_t pool_count, peak_pool_count, reclaimed_pool_count;
+/* Descriptor pool is being allocated */
+static bool allocating_pool;
+/* Number of pages with lazy references */
+static size_t lazy_ref_count;
+/* Number of compacted blocks and migrated pages */
+static size_t compacted_count, migrated_count;
+/* Number of compaction attempts skipped after failure */
+static size_t compact_deferred;
+/* Number of promoted huge pages and ones that required migration */
+static size_t promoted_count, promoted_copy_count;
+/* Number of lazy copies made on page faults and ahead of them */
+static size_t lazy_fault_count, fault_around_count;
+/* Pending TLB invalidations (single CPU for now) */
+static struct TlbGather tlb_gather;
+/* Number of whole TLB flushes and selectively invalidated pages */
+static size_t tlb_flush_count, tlb_invlpg_count;
+/* Virtual tree lookups start from radix index
+ * (can be disabled to compare with plain binary tree) */
+#ifdef NO_VIRTUAL_RADIX
+static bool virtual_radix = 0;
+#else
+static bool virtual_radix = 1;
+#endif
+/* Number of radix directories, lookups started from them
+ * and virtual tree nodes visited by lookups */
+static size_t vdir_count, vdir_hits, lookup_steps;
 /* Physical memory size */
 size_t max_memory_map_addr;
 /* Kernel address space */
@@ -45,6 +134,12 @@ static uintptr_t metaheaptop;
 static bool nx_supported = 1;
 /* 1GB pages are supported */
 static bool has_1gb_pages = 1;
+/* Global pages and process-context identifiers are supported */
+static bool pge_supported, pcid_supported;
+/* PCIDs are assigned sequentially within generation
+ * (PCID 0 is never assigned and is used for untagged loads) */
+static uint16_t pcid_next = 1;
+static uint64_t pcid_generation = 1;
 
 /* Kernel executable end virtual address */
 extern char end[];
@@ -56,6 +151,8 @@ extern char pfstacktop[], pfstack[];
 #define ALLOC_WEAK 0x20000
 /* Allocate page within [0; BOOT_MEM_SIZE) */
 #define ALLOC_BOOTMEM 0x40000
+/* Allocate page within [0; DMA_MEM_SIZE) */
+#define ALLOC_DMA 0x80000
 
 /* Descriptor pool page size */
 #define POOL_CLASS 1
@@ -67,7 +164,43 @@ extern char pfstacktop[], pfstack[];
 #define PAGE_IS_FREE(p) (!(p)->refc && !(p)->left && !(p)->right)
 #define PAGE_IS_UNIQ(p) ((p)->refc == 1 && !(p)->left && !(p)->right)
 
-#define INIT_DESCR 256
+
+/* Number of descriptors in one pool */
+#define POOL_DESCR POOL_ENTRIES_FOR_SIZE(CLASS_SIZE(POOL_CLASS))
+/* Empty pools are released when there are more free
+ * descriptors than DESC_HIGH_WATERMARK, but at least
+ * DESC_LOW_WATERMARK free descriptors are always kept */
+#define DESC_HIGH_WATERMARK (8 * POOL_DESCR)
+#define DESC_LOW_WATERMARK  (2 * POOL_DESCR)
+/* Enough descriptors to split any page down to POOL_CLASS */
+#define DESC_RESERVE (2 * (MAX_CLASS + 1))
+
+/* Compaction only evacuates blocks that are at most half used */
+#define COMPACT_MAX_USED(class) (CLASS_SIZE(class) / 2)
+/* Number of attempts skipped after compaction failed */
+#define COMPACT_DEFER 64
+
+/* Number of page table pages kept zeroed in idle loop */
+#define PT_CACHE_TARGET (ZERO_CACHE_SIZE / 4)
+/* Page tables are taken from boot memory for early KASAN */
+#define PT_ALLOC_FLAGS ALLOC_BOOTMEM
+
+/* Maximal number of invlpg instructions executed instead of flushing whole TLB */
+#define TLB_FLUSH_THRESHOLD 64
+
+/* Maximal number of huge pages formed per promote_memory() call */
+#define PROMOTE_BATCH 8
+/* Page table entry bits that should be equal within promoted block */
+#define PROMOTE_PTE_MASK (PTE_SYSCALL | PTE_PWT | PTE_PCD | PTE_NX)
+
+/* Metadata-light address spaces keep protection flags that have no
+ * hardware bits and class of the mapped page in ignored PTE bits */
+#define PTE_LIGHT_R           (1ULL << 52)
+#define PTE_LIGHT_W           (1ULL << 53)
+#define PTE_LIGHT_X           (1ULL << 54)
+#define PTE_LIGHT_LAZY        (1ULL << 55)
+#define PTE_LIGHT_CLASS_SHIFT 56
+#define PTE_LIGHT_CLASS(pte)  ((int)((pte) >> PTE_LIGHT_CLASS_SHIFT) & 0x3F)
 
 #define ABSDIFF(x, y) ((x) > (y) ? (x) - (y) : (y) - (x))
 
@@ -76,12 +209,12 @@ extern char pfstacktop[], pfstack[];
 
 inline static bool __attribute__((always_inline))
 list_empty(struct List *list) {
-    return list->next == list;
+    return listptr(list->next) == list;
 }
 
 inline static void __attribute__((always_inline))
 list_init(struct List *list) {
-    list->next = list->prev = list;
+    list->next = list->prev = pglink(list);
 }
 
 /*
@@ -90,13 +223,12 @@ list_init(struct List *list) {
 inline static void __attribute__((always_inline))
 list_append(struct List *list, struct List *new) {
     // LAB 6: Your code here
-    struct List *after = list->next;
+    struct List *after = listptr(list->next);
 
-    new->next = after;
-    new->prev = list;
+    new->next = list->next;
+    new->prev = pglink(list);
 
-    list->next = new;
-    after->prev = new;
+    list->next = after->prev = pglink(new);
 }
 
 /*
@@ -106,8 +238,8 @@ list_append(struct List *list, struct List *new) {
 inline static struct List *__attribute__((always_inline))
 list_del(struct List *list) {
     // LAB 6: Your code here.
-    list->prev->next = list->next;
-    list->next->prev = list->prev;
+    listptr(list->prev)->next = list->next;
+    listptr(list->next)->prev = list->prev;
 
     list_init(list);
 
@@ -115,43 +247,130 @@ list_del(struct List *list) {
 }
 
 static struct Page *alloc_page(int class, int flags);
+static void reclaim_pools(void);
+static struct Page *pt_page_alloc(void);
+static void pt_page_free(pte_t *pt);
+
+/* Returns NUMA node of physical address */
+inline static int
+pa_node(physaddr_t pa) {
+    for (size_t i = 0; i < numa_range_count; i++)
+        if (pa >= numa_ranges[i].start && pa < numa_ranges[i].end)
+            return numa_ranges[i].node;
+    return 0;
+}
+
+/*
+ * Returns true if page lies within single NUMA node.
+ * Free pages are never merged across node boundaries
+ */
+inline static bool
+page_node_uniform(struct Page *page) {
+    physaddr_t start = page2pa(page), end = start + CLASS_SIZE(page->class);
+    for (size_t i = 0; i < numa_range_count; i++) {
+        if (numa_ranges[i].start > start && numa_ranges[i].start < end) return 0;
+        if (numa_ranges[i].end > start && numa_ranges[i].end < end) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Returns free list that free allocatable page belongs to.
+ * Zone is determined by the start address of the page:
+ * since pages are aligned on their size the only page
+ * that can cross zone boundary is the one starting at 0
+ */
+inline static struct List *
+page_free_list(struct Page *page) {
+    physaddr_t pa = page2pa(page);
+    enum MemoryZone zone = pa < DMA_MEM_SIZE  ? ZONE_DMA :
+                           pa < BOOT_MEM_SIZE ? ZONE_BOOT :
+                                                ZONE_HIGH;
+    return &free_classes[pa_node(pa)][zone][page->class];
+}
 
+/*
+ * Makes sure that at least count descriptors are available.
+ * DESC_RESERVE more descriptors are always kept free so that
+ * new pool can be split off the buddy tree without using
+ * its own descriptors
+ */
 void
 ensure_free_desc(size_t count) {
-    if (free_desc_count < count) {
-        struct Page *res = alloc_page(POOL_CLASS, ALLOC_POOL);
-        (void)res;
-        if (!res) panic("Out of memory\n");
+    while (!allocating_pool && free_desc_count < count + DESC_RESERVE) {
+        /* There might be no allocatable memory yet
+         * while memory map is being attached */
+        if (!alloc_page(POOL_CLASS, ALLOC_POOL)) {
+            if (free_desc_count < count) panic("Out of memory\n");
+            break;
+        }
     }
 
     assert(free_desc_count >= count);
-    assert(!list_empty(&free_descriptors));
+    assert(!list_empty(&partial_pools));
+}
+
+/* Descriptors used before the first pool is allocated */
+static uint8_t initial_pool[CLASS_SIZE(POOL_CLASS)] __attribute__((aligned(CLASS_SIZE(POOL_CLASS))));
+
+inline static struct PagePool *
+desc_pool(struct Page *page) {
+    return (struct PagePool *)ROUNDDOWN((uintptr_t)page, CLASS_SIZE(POOL_CLASS));
+}
+
+/*
+ * Makes descriptors of the new pool available.
+ * New pools are used only after the older ones are full
+ * so that recently allocated pools are more likely
+ * to become empty and to be released
+ */
+static void
+add_pool(struct PagePool *pool, struct Page *peer) {
+    list_init(&pool->free);
+    for (size_t i = 0; i < POOL_DESCR; i++)
+        list_append(listptr(pool->free.prev), (struct List *)&pool->data[i]);
+    list_append(listptr(partial_pools.prev), &pool->partial);
+    pool->peer = peer;
+    pool->used = 0;
+    free_desc_count += POOL_DESCR;
+    total_desc_count += POOL_DESCR;
 }
 
 static struct Page *
 alloc_descriptor(enum PageState state) {
     ensure_free_desc(1);
 
-    struct Page *new = (struct Page *)list_del(free_descriptors.next);
+    struct PagePool *pool = (struct PagePool *)((uint8_t *)listptr(partial_pools.next) - offsetof(struct PagePool, partial));
+    struct Page *new = (struct Page *)list_del(listptr(pool->free.next));
+    if (list_empty(&pool->free)) list_del(&pool->partial);
+    pool->used++;
 
     memset(new, 0, sizeof *new);
     list_init((struct List *)new);
     new->state = state;
     free_desc_count--;
+    peak_desc_count = MAX(peak_desc_count, total_desc_count - free_desc_count);
 
     return new;
 }
 
 static void
 free_descriptor(struct Page *page) {
+    struct PagePool *pool = desc_pool(page);
+    assert(pool->used);
+
+    /* Pool that was full is filled first again */
+    if (list_empty(&pool->free)) list_append(&partial_pools, &pool->partial);
+    pool->used--;
+
     list_del((struct List *)page);
-    list_append(&free_descriptors, (struct List *)page);
+    list_append(&pool->free, (struct List *)page);
     free_desc_count++;
 }
 
 static void
 _assert_root(const char *file, int line, struct Page *p, bool phy) {
-    while (p->parent) p = p->parent;
+    while (p->parent) p = pgptr(p->parent);
     if ((p == &root) != phy)
         _panic(file, line, "Page %p (phy %p) should%s be physical\n", p, (void *)PADDR(p), phy ? "" : "n't");
 }
@@ -160,13 +379,225 @@ static void
 free_desc_rec(struct Page *p) {
     while (p) {
         assert(!p->refc);
-        free_desc_rec(p->right);
-        struct Page *tmp = p->left;
+        free_desc_rec(pgptr(p->right));
+        struct Page *tmp = pgptr(p->left);
         free_descriptor(p);
         p = tmp;
     }
 }
 
+/*
+ * References node without touching its children.
+ * Reference of the page that has children is
+ * propagated to them lazily by page_push()
+ */
+static void
+page_ref_one(struct Page *node) {
+    assert(node->refc < MAX_REFC);
+    if (!node->refc++) {
+        list_del((struct List *)node);
+        list_init((struct List *)node);
+        node->lazy_ref = node->left || node->right;
+        lazy_ref_count += node->lazy_ref;
+    }
+}
+
+/*
+ * Propagates reference of the page as a whole to its children.
+ * Children reference counts are only valid after this
+ */
+inline static void
+page_push(struct Page *node) {
+    if (!node->lazy_ref) return;
+    node->lazy_ref = 0;
+    lazy_ref_count--;
+    page_ref_one(pgptr(node->left));
+    page_ref_one(pgptr(node->right));
+}
+
+/*
+ * Propagates lazy references of all ancestors
+ * down to the node, so that its refc becomes valid.
+ * This takes O(depth) time
+ */
+static void
+page_push_path(struct Page *node) {
+    /* Nothing to push most of the time */
+    if (!lazy_ref_count) return;
+
+    struct Page *top = NULL;
+    for (struct Page *par = pgptr(node->parent); par; par = pgptr(par->parent))
+        if (par->lazy_ref) top = par;
+    if (!top) return;
+
+    physaddr_t pa = page2pa(node);
+    for (struct Page *par = top; par != node;
+         par = pgptr(pa & CLASS_SIZE(par->class - 1) ? par->right : par->left))
+        page_push(par);
+}
+
+/* Returns true if some ancestor of the node references it */
+static bool
+page_covered(struct Page *node) {
+    for (struct Page *par = pgptr(node->parent); par; par = pgptr(par->parent))
+        if (par->refc) return 1;
+    return 0;
+}
+
+/* Returns true if page is a part of shared zero-filled page */
+inline static bool
+page_is_zero(struct Page *page) {
+    return page2pa(page) >= page2pa(zero_page) &&
+           page2pa(page) < page2pa(zero_page) + CLASS_SIZE(zero_page->class);
+}
+
+inline static bool
+page_is_one(struct Page *page) {
+    return page2pa(page) >= page2pa(one_page) &&
+           page2pa(page) < page2pa(one_page) + CLASS_SIZE(one_page->class);
+}
+
+/* Filler pages are mapped lazily everywhere and copied on first write */
+inline static bool
+page_is_filler(struct Page *page) {
+    return (zero_page && page_is_zero(page)) || (one_page && page_is_one(page));
+}
+
+/*
+ * User address spaces indexed by roots of their virtual trees
+ * (open addressing with linear probing), so that mappings
+ * from reverse maps are resolved to their spaces in constant time
+ */
+#define SPACE_INDEX_SIZE (2 * NENV)
+
+static struct AddressSpace *space_index[SPACE_INDEX_SIZE];
+static size_t space_index_count;
+
+static size_t
+space_index_slot(struct Page *root) {
+    return ((uint64_t)pglink(root) * 0x9E3779B97F4A7C15ULL >> 32) % SPACE_INDEX_SIZE;
+}
+
+static struct AddressSpace *
+space_index_find(struct Page *root) {
+    for (size_t i = space_index_slot(root); space_index[i]; i = (i + 1) % SPACE_INDEX_SIZE)
+        if (space_index[i]->root == root) return space_index[i];
+    return NULL;
+}
+
+static void
+space_index_add(struct AddressSpace *spc) {
+    assert(space_index_count < SPACE_INDEX_SIZE - 1);
+    size_t i = space_index_slot(spc->root);
+    while (space_index[i]) i = (i + 1) % SPACE_INDEX_SIZE;
+    space_index[i] = spc;
+    space_index_count++;
+}
+
+/* Removes space from the index. Root of the space should not be changed yet */
+static void
+space_index_del(struct AddressSpace *spc) {
+    size_t i = space_index_slot(spc->root);
+    while (space_index[i] != spc) {
+        assert(space_index[i]);
+        i = (i + 1) % SPACE_INDEX_SIZE;
+    }
+
+    /* Entries following the hole are moved into it
+     * unless their probe sequence starts after it */
+    for (size_t j = (i + 1) % SPACE_INDEX_SIZE; space_index[j]; j = (j + 1) % SPACE_INDEX_SIZE) {
+        size_t home = space_index_slot(space_index[j]->root);
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            space_index[i] = space_index[j];
+            i = j;
+        }
+    }
+    space_index[i] = NULL;
+    space_index_count--;
+}
+
+/*
+ * Cached maximal reference counts are valid only within
+ * the generation they were computed in (0 is never current),
+ * so all caches are dropped at once by starting new generation
+ */
+static uint16_t maxref_generation = 1;
+
+/* Nodes visited by reverse map walk before
+ * all caches are dropped instead */
+#define MAXREF_WALK_MAX 64
+/* Largest count that fits the cache */
+#define MAXREF_MAX 0xFFFF
+
+inline static bool
+maxref_valid(struct Page *node) {
+    return node->maxref_gen == maxref_generation;
+}
+
+/* Drops caches of the whole virtual subtree */
+static void
+maxref_reset(struct Page *node) {
+    if (!node) return;
+    node->maxref_gen = 0;
+    maxref_reset(pgptr(node->left));
+    maxref_reset(pgptr(node->right));
+}
+
+static void
+maxref_invalidate_all(void) {
+    if (++maxref_generation) return;
+
+    /* Caches of old generations would become valid
+     * again after wraparound, so they are cleared */
+    for (size_t i = 0; i < SPACE_INDEX_SIZE; i++)
+        if (space_index[i]) maxref_reset(space_index[i]->root);
+    maxref_generation = 1;
+}
+
+/*
+ * Drops cached maximal reference count of virtual node
+ * and its ancestors. Descendants of the node with valid
+ * cache are always valid too, so the walk stops
+ * at the first invalid node
+ */
+static void
+maxref_invalidate(struct Page *node) {
+    while (node && maxref_valid(node)) {
+        node->maxref_gen = 0;
+        node = pgptr(node->parent);
+    }
+}
+
+/* Returns false if budget of visited nodes is exhausted */
+static bool
+maxref_invalidate_walk(struct Page *page, bool subtree, size_t *budget) {
+    if (!page || page_is_filler(page)) return 1;
+    if (!(*budget)--) return 0;
+
+    /* Only referenced pages are mapped (free ones are in free lists) */
+    if (page->refc) {
+        for (struct List *li = listptr(page->head.next); li != &page->head; li = listptr(li->next)) {
+            if (!(*budget)--) return 0;
+            maxref_invalidate((struct Page *)li);
+        }
+    }
+    return !subtree || (maxref_invalidate_walk(pgptr(page->left), 1, budget) &&
+                        maxref_invalidate_walk(pgptr(page->right), 1, budget));
+}
+
+/*
+ * Drops cached maximal reference counts of all mappings of
+ * the physical page after its reference count is changed.
+ * Lazy references change counts of the whole subtree.
+ * Widely shared pages drop all caches instead of walking
+ * their reverse maps, so the cost of every change is bounded
+ */
+static void
+maxref_invalidate_phy(struct Page *page, bool subtree) {
+    size_t budget = MAXREF_WALK_MAX;
+    if (!maxref_invalidate_walk(page, subtree, &budget)) maxref_invalidate_all();
+}
+
 /*
  * This function allocates child
  * node for given parent in physical memory tree
@@ -194,17 +625,18 @@ alloc_child(struct Page *parent, bool right) {
     if (!parent->class)
         return NULL;
 
+    /* Mappings of the parent count its children */
+    if (!parent->left && !parent->right) maxref_invalidate_phy(parent, 0);
+
     struct Page *new = alloc_descriptor(parent->state);
-    new->parent = parent;
+    new->parent = pglink(parent);
 
     new->class = parent->class - 1;
-    if (right) {
-        parent->right = new;
-        new->addr = parent->addr + (1ULL << new->class);
-    } else {
-        parent->left = new;
-        new->addr = parent->addr;
-    }
+    new->index = parent->index * 2 + right;
+    if (right)
+        parent->right = pglink(new);
+    else
+        parent->left = pglink(new);
     if (parent->refc)
         new->refc = 1;
 
@@ -222,6 +654,9 @@ page_lookup(struct Page *hint, uintptr_t addr, int class, enum PageState type, b
     assert(!(addr & CLASS_MASK(class)));
     assert(node);
 
+    /* Reference counts of looked up nodes should be valid */
+    if (hint) page_push_path(hint);
+
     while (node && node->class > class) {
         assert(class >= 0);
         bool right = addr & CLASS_SIZE(node->class - 1);
@@ -234,10 +669,10 @@ page_lookup(struct Page *hint, uintptr_t addr, int class, enum PageState type, b
 
             if (was_free) {
                 /* Recalculate free lists for allocatable page */
-                struct Page *other = !right ? node->right : node->left;
+                struct Page *other = pgptr(!right ? node->right : node->left);
                 assert(other->state == ALLOCATABLE_NODE);
                 list_del((struct List *)node);
-                list_append(&free_classes[node->class - 1], (struct List *)other);
+                list_append(page_free_list(other), (struct List *)other);
             }
 
             if (type != PARTIAL_NODE && node->state != type)
@@ -246,7 +681,8 @@ page_lookup(struct Page *hint, uintptr_t addr, int class, enum PageState type, b
 
         assert((node->left && node->right) || !alloc);
 
-        node = right ? node->right : node->left;
+        page_push(node);
+        node = pgptr(right ? node->right : node->left);
     }
 
     if (alloc) assert(node);
@@ -255,14 +691,14 @@ page_lookup(struct Page *hint, uintptr_t addr, int class, enum PageState type, b
         assert(!node->refc);
 
         /* Need to free old subtree when retyping memory */
-        free_desc_rec(node->left);
-        free_desc_rec(node->right);
-        node->left = node->right = NULL;
+        free_desc_rec(pgptr(node->left));
+        free_desc_rec(pgptr(node->right));
+        node->left = node->right = 0;
         list_del((struct List *)node);
 
         /* We cannot change RESERVED_NODE memory to ALLOCATABLE_NODE */
         if (type != PARTIAL_NODE && node->state != RESERVED_NODE) node->state = type;
-        if (node->state == ALLOCATABLE_NODE) list_append(&free_classes[node->class], (struct List *)node);
+        if (node->state == ALLOCATABLE_NODE) list_append(page_free_list(node), (struct List *)node);
 
         if (trace_memory) cprintf("Attaching page (%x) at %p class=%d\n", node->state, (void *)page2pa(node), (int)node->class);
     }
@@ -276,20 +712,19 @@ static void
 page_ref(struct Page *node) {
     if (!node) return;
 
-    /* If parent is allocated
-     * all of its children are allocated too,
-     * so need to reference them recursively
-     * when refc transitions from 0 to 1 */
-    if (!node->refc++) {
-        list_del((struct List *)node);
-        list_init((struct List *)node);
-        page_ref(node->left);
-        page_ref(node->right);
-    }
+    /* If parent is allocated all of its children are
+     * allocated too, but instead of referencing them
+     * recursively when refc transitions from 0 to 1
+     * reference is pushed down only when children
+     * are looked up */
+    page_push_path(node);
+    page_ref_one(node);
+    maxref_invalidate_phy(node, node->refc == 1 && node->lazy_ref);
 }
 
+/* Drops reference of the node with valid refc */
 static void
-page_unref(struct Page *page) {
+do_buddy_unref(struct Page *page) {
     if (!page) return;
     assert_physical(page);
     assert(page->refc);
@@ -298,30 +733,53 @@ page_unref(struct Page *page) {
      * this if statement is important
      * to prevent double frees */
 
+    bool lazy = 0;
     if (page->refc == 1) {
-        page_unref(page->left);
-        page_unref(page->right);
+        /* Children only need to be dereferenced
+         * if they have received the reference */
+        if ((lazy = page->lazy_ref)) {
+            page->lazy_ref = 0;
+            lazy_ref_count--;
+        } else {
+            do_buddy_unref(pgptr(page->left));
+            do_buddy_unref(pgptr(page->right));
+        }
     }
 
     page->refc--;
+    maxref_invalidate_phy(page, lazy);
+
+    /* Children cannot be merged while the parent is referenced
+     * as a whole, so merge them now if they became free meanwhile */
+    struct Page *left = pgptr(page->left), *right = pgptr(page->right);
+    if (!page->refc && left && right &&
+        left->state == page->state &&
+        right->state == page->state &&
+        PAGE_IS_FREE(left) && PAGE_IS_FREE(right) &&
+        page_node_uniform(page)) {
+        free_descriptor(left);
+        free_descriptor(right);
+        page->left = page->right = 0;
+    }
 
     /* Try to merge free page with adjacent */
     if (PAGE_IS_FREE(page)) {
         while (page != &root) {
-            struct Page *par = page->parent;
+            struct Page *par = pgptr(page->parent);
             assert_physical(par);
-            if (par->state == page->state &&
-                PAGE_IS_FREE(par->left) &&
-                PAGE_IS_FREE(par->right)) {
-                free_descriptor(par->left);
-                par->left = NULL;
+            if (par->state == page->state && !par->refc &&
+                PAGE_IS_FREE(pgptr(par->left)) &&
+                PAGE_IS_FREE(pgptr(par->right)) &&
+                page_node_uniform(par)) {
+                free_descriptor(pgptr(par->left));
+                par->left = 0;
 
-                free_descriptor(par->right);
-                par->right = NULL;
+                free_descriptor(pgptr(par->right));
+                par->right = 0;
 
                 if (par->state == ALLOCATABLE_NODE) {
                     assert(list_empty((struct List *)par));
-                    list_append(&free_classes[par->class], (struct List *)par);
+                    list_append(page_free_list(par), (struct List *)par);
                 }
                 page = par;
             } else
@@ -329,7 +787,7 @@ page_unref(struct Page *page) {
         }
         list_del((struct List *)page);
         if (page->state == ALLOCATABLE_NODE)
-            list_append(&free_classes[page->class], (struct List *)page);
+            list_append(page_free_list(page), (struct List *)page);
 
 #if SANITIZE_SHADOW_BASE
         if (current_space) {
@@ -339,16 +797,90 @@ page_unref(struct Page *page) {
     }
 }
 
+/*
+ * Drops reference to the page and returns it
+ * to the buddy tree when it becomes free
+ */
+static void
+buddy_unref(struct Page *page) {
+    if (!page) return;
+
+    page_push_path(page);
+    do_buddy_unref(page);
+}
+
+/*
+ * Returns true if page released by its last reference
+ * is a standalone 4K page that can be kept in magazine.
+ * Pages that are the parts of bigger referenced pages
+ * are always returned to the buddy tree.
+ */
+inline static bool
+page_cacheable(struct Page *page) {
+    return page->refc == 1 && !page->class &&
+           page->state == ALLOCATABLE_NODE &&
+           page->parent && !pgptr(page->parent)->refc &&
+           !page->left && !page->right;
+}
+
+/*
+ * Returns up to count pages from magazine to the buddy tree.
+ * Returns number of released pages
+ */
+static size_t
+magazine_drain(struct PageMagazine *mag, size_t count) {
+    size_t n = MIN(count, mag->count);
+
+    /* The oldest pages are at the bottom of the stack */
+    for (size_t i = 0; i < n; i++)
+        buddy_unref(mag->pages[i]);
+    memmove(mag->pages, mag->pages + n, (mag->count - n) * sizeof *mag->pages);
+    mag->count -= n;
+
+    return n;
+}
+
+static void
+page_unref(struct Page *page) {
+    if (!page) return;
+    assert_physical(page);
+
+    page_push_path(page);
+    if (page_cacheable(page)) {
+        struct PageMagazine *mag = this_magazine();
+        if (mag->count == MAGAZINE_SIZE)
+            magazine_drain(mag, MAGAZINE_BATCH);
+
+        /* Page stays referenced while it is in magazine
+         * so it cannot be merged with its buddy */
+        list_del((struct List *)page);
+        mag->pages[mag->count++] = page;
+
+#if SANITIZE_SHADOW_BASE
+        if (current_space) {
+            platform_asan_poison(KADDR(page2pa(page)), CLASS_SIZE(0));
+        }
+#endif
+        return;
+    }
+
+    do_buddy_unref(page);
+}
+
 void
-alloc_virtual_child(struct Page *parent, struct Page **dst) {
+alloc_virtual_child(struct Page *parent, bool right) {
     assert_virtual(parent);
-    assert(parent->phy && parent->phy->left && parent->phy->right);
+    struct Page *phy = pgptr(parent->phy);
+    assert(phy && phy->left && phy->right);
 
-    if ((*dst = alloc_descriptor(parent->state))) {
-        (*dst)->parent = parent;
-        (*dst)->phy = dst == &parent->left ? parent->phy->left : parent->phy->right;
-        page_ref((*dst)->phy);
-        list_append((struct List *)(*dst)->phy, (struct List *)(*dst));
+    struct Page *new = alloc_descriptor(parent->state);
+    if (new) {
+        new->parent = pglink(parent);
+        new->phy = right ? phy->right : phy->left;
+        page_ref(pgptr(new->phy));
+        list_append(listptr(new->phy), (struct List *)new);
+        *(right ? &parent->right : &parent->left) = pglink(new);
+        maxref_invalidate(parent);
     }
 }
 
@@ -373,24 +905,209 @@ alloc_virtual_child(struct Page *parent, struct Page **dst) {
  */
 static void
 check_virtual_class(struct Page *node, int class) {
-    while (node->parent) class ++, node = node->parent;
+    while (node->parent) class ++, node = pgptr(node->parent);
     assert(class == MAX_CLASS);
 }
 
-/* Lookup virtual address space mapping node with given address and class */
+/*
+ * Virtual tree is binary, so lookups from its root visit up
+ * to MAX_CLASS nodes. Radix index keeps tree nodes of the classes
+ * of page table levels (512GB, 1GB and 2MB) in 512-entry directories
+ * indexed like page tables, so lookups start at most 9 levels above
+ * the page. Index is only a shortcut: missing nodes are looked up
+ * from above, so nodes are remembered only when their directory
+ * exists, and directories are allocated only for 2MB nodes
+ * found by allocating lookups. Index covers the range of its
+ * top directory and grows upwards when needed, so spaces
+ * within single 1GB region need just one directory.
+ */
+
+/* Returns index of the entry covering addr in directory of given level */
+inline static int
+vdir_index(uintptr_t addr, int level) {
+    return (addr >> (VDIR_CLASS(level) + CLASS_BASE)) & (VDIR_ENTRIES - 1);
+}
+
+inline static struct VirtualDir *
+vdir_next(struct VirtualDir *dir, int i) {
+    return dir->next[i] ? KADDR((physaddr_t)dir->next[i] << CLASS_BASE) : NULL;
+}
+
+/* Returns radix index level keeping nodes of the class or -1 */
+inline static int
+vdir_level(int class) {
+    int level = (VDIR_CLASS(0) - class) / 9;
+    return class <= VDIR_CLASS(0) && level < VDIR_LEVELS && VDIR_CLASS(level) == class ? level : -1;
+}
+
+/* Returns true if radix index of the space covers addr at the level */
+inline static bool
+vdir_covers(struct AddressSpace *spc, uintptr_t addr, int level) {
+    return spc->vdir && level >= spc->vdir_level &&
+           addr - spc->vdir_base < CLASS_SIZE(VDIR_CLASS(spc->vdir_level) + 9);
+}
+
+static struct VirtualDir *
+vdir_alloc(void) {
+    struct Page *page = pt_page_alloc();
+    if (!page) return NULL;
+#ifdef SANITIZE_SHADOW_BASE
+    if (current_space) platform_asan_unpoison(KADDR(page2pa(page)), CLASS_SIZE(0));
+#endif
+    vdir_count++;
+    return KADDR(page2pa(page));
+}
+
+/* Releases directory with all lower level ones */
+static void
+vdir_free(struct VirtualDir *dir, int level) {
+    for (int i = 0; i < VDIR_ENTRIES && level < VDIR_LEVELS - 1; i++)
+        if (dir->next[i]) vdir_free(vdir_next(dir, i), level + 1);
+
+    /* Page table cache keeps zeroed pages */
+    memset(dir, 0, sizeof *dir);
+    pt_page_free((pte_t *)dir);
+    vdir_count--;
+}
+
+/*
+ * Returns the lowest node of class not less than class
+ * containing addr from radix index of the space (and its
+ * class in *nclass) or NULL if there is no such node
+ */
+static struct Page *
+vdir_lookup(struct AddressSpace *spc, uintptr_t addr, int class, int *nclass) {
+    if (!vdir_covers(spc, addr, spc->vdir_level)) return NULL;
+
+    struct Page *res = NULL;
+    struct VirtualDir *dir = spc->vdir;
+    for (int level = spc->vdir_level; dir && level < VDIR_LEVELS && VDIR_CLASS(level) >= class; level++) {
+        int i = vdir_index(addr, level);
+        if (dir->nodes[i]) {
+            res = pgptr(dir->nodes[i]);
+            *nclass = VDIR_CLASS(level);
+        }
+        dir = vdir_next(dir, i);
+    }
+    return res;
+}
+
+/* Adds directory above the top one, so that index covers addr */
+static bool
+vdir_grow(struct AddressSpace *spc, uintptr_t addr) {
+    if (!spc->vdir) {
+        if (!(spc->vdir = vdir_alloc())) return 0;
+        spc->vdir_level = VDIR_LEVELS - 1;
+        spc->vdir_base = ROUNDDOWN(addr, CLASS_SIZE(VDIR_CLASS(VDIR_LEVELS - 1) + 9));
+        return 1;
+    }
+
+    assert(spc->vdir_level);
+    struct VirtualDir *dir = vdir_alloc();
+    if (!dir) return 0;
+
+    int level = spc->vdir_level - 1;
+    dir->next[vdir_index(spc->vdir_base, level)] = PADDR(spc->vdir) >> CLASS_BASE;
+    spc->vdir = dir;
+    spc->vdir_level = level;
+    spc->vdir_base = ROUNDDOWN(spc->vdir_base, CLASS_SIZE(VDIR_CLASS(level) + 9));
+    return 1;
+}
+
+/*
+ * Remembers virtual tree node of class of radix index level
+ * found by lookup. Directories are allocated for 2MB nodes
+ * if alloc is set, allocation failures are ignored
+ */
+static void
+vdir_insert(struct AddressSpace *spc, struct Page *node, uintptr_t addr, int level, bool alloc) {
+    alloc &= level == VDIR_LEVELS - 1;
+    if (addr >= VDIR_LIMIT) return;
+
+    while (!vdir_covers(spc, addr, level))
+        if (!alloc || !vdir_grow(spc, addr)) return;
+
+    struct VirtualDir *dir = spc->vdir;
+    for (int lvl = spc->vdir_level; lvl < level; lvl++) {
+        int i = vdir_index(addr, lvl);
+        if (!dir->next[i]) {
+            struct VirtualDir *new = alloc ? vdir_alloc() : NULL;
+            if (!new) return;
+            dir->next[i] = PADDR(new) >> CLASS_BASE;
+        }
+        dir = vdir_next(dir, i);
+    }
+    dir->nodes[vdir_index(addr, level)] = pglink(node);
+}
+
+/* Forgets virtual tree node of class of radix index level being freed */
+static void
+vdir_remove(struct AddressSpace *spc, struct Page *node, uintptr_t addr, int level) {
+    if (!vdir_covers(spc, addr, level)) return;
+
+    struct VirtualDir *dir = spc->vdir;
+    for (int lvl = spc->vdir_level; dir && lvl < level; lvl++)
+        dir = vdir_next(dir, vdir_index(addr, lvl));
+
+    int i = vdir_index(addr, level);
+    if (dir && dir->nodes[i] == pglink(node)) dir->nodes[i] = 0;
+}
+
+/* Positions cursor at the root of the virtual tree of address space */
+inline static void
+cursor_init(struct PageCursor *cur, struct AddressSpace *spc) {
+    cur->space = spc;
+    cur->node = spc->root;
+    cur->addr = 0;
+    cur->class = MAX_CLASS;
+}
+
+/*
+ * Lookup virtual address space mapping node with given address and class
+ * starting from the node remembered by cursor. Lookup climbs up to the
+ * lowest common ancestor of the old and new nodes first, so sequential
+ * lookups of adjacent addresses take amortized O(1) time.
+ * Cursor is left at the found node.
+ * NOTE: Cursor is invalidated when its node is freed
+ */
 static struct Page *
-page_lookup_virtual(struct Page *node, uintptr_t addr, int class, int alloc) {
+page_lookup_cursor(struct PageCursor *cur, uintptr_t addr, int class, int alloc) {
     assert(class >= 0);
-    assert_virtual(node);
 
+    /* Class of the common ancestor of cursor node and the node looked up */
+    int common = cur->class;
+    while (common < MAX_CLASS &&
+           (common < class || ROUNDDOWN(addr, CLASS_SIZE(common)) != ROUNDDOWN(cur->addr, CLASS_SIZE(common))))
+        common++;
+
+    /* Start from radix index if it has lower node than the common one */
+    int vclass = 0;
+    struct Page *vnode = virtual_radix && common > VDIR_CLASS(VDIR_LEVELS - 1) ?
+                                 vdir_lookup(cur->space, addr, class, &vclass) : NULL;
+    if (vnode && vclass < common) {
+        cur->node = vnode;
+        cur->class = vclass;
+        cur->addr = ROUNDDOWN(addr, CLASS_SIZE(vclass));
+        vdir_hits++;
+    } else {
+        while (cur->class < common) {
+            cur->node = pgptr(cur->node->parent);
+            cur->class++;
+            cur->addr = ROUNDDOWN(cur->addr, CLASS_SIZE(cur->class));
+            lookup_steps++;
+        }
+    }
+
+    struct Page *node = cur->node;
+    assert_virtual(node);
 
-    int nclass = MAX_CLASS;
+    int nclass = cur->class;
     while (nclass > class) {
         assert(nclass > 0);
         bool right = addr & CLASS_SIZE(nclass - 1);
 
 
-        struct Page **next = right ? &node->right : &node->left;
+        pglink_t *next = right ? &node->right : &node->left;
 
         if (!*next) {
             if (!alloc) break;
@@ -399,32 +1116,43 @@ page_lookup_virtual(struct Page *node, uintptr_t addr, int class, int alloc) {
 
             assert(nclass);
             if (node->phy) {
-                assert(nclass == node->phy->class);
+                struct Page *phy = pgptr(node->phy);
+                assert(nclass == phy->class);
                 assert((node->state & NODE_TYPE_MASK) == MAPPING_NODE);
 
-                struct Page *pleft = page_lookup(node->phy, page2pa(node->phy), node->phy->class - 1, PARTIAL_NODE, 1);
+                struct Page *pleft = page_lookup(phy, page2pa(phy), phy->class - 1, PARTIAL_NODE, 1);
                 if (!pleft) return NULL;
 
-                assert(node->phy->left && node->phy->right);
+                assert(phy->left && phy->right);
 
-                alloc_virtual_child(node, &node->left);
+                alloc_virtual_child(node, 0);
                 if (!node->left) return NULL;
-                alloc_virtual_child(node, &node->right);
+                alloc_virtual_child(node, 1);
                 if (!node->right) return NULL;
 
                 list_del((struct List *)node);
-                page_unref(node->phy);
-                node->phy = NULL;
+                page_unref(phy);
+                node->phy = 0;
                 node->state = INTERMEDIATE_NODE;
             } else {
                 assert(node->state == INTERMEDIATE_NODE);
-                *next = alloc_descriptor(INTERMEDIATE_NODE);
-                (*next)->parent = node;
+                struct Page *new = alloc_descriptor(INTERMEDIATE_NODE);
+                new->parent = pglink(node);
+                *next = pglink(new);
+                maxref_invalidate(node);
             }
             assert(*next);
         }
-        node = *next;
+        node = pgptr(*next);
         nclass--;
+        lookup_steps++;
+
+        cur->node = node;
+        cur->class = nclass;
+        cur->addr = ROUNDDOWN(addr, CLASS_SIZE(nclass));
+
+        int level = vdir_level(nclass);
+        if (virtual_radix && level >= 0) vdir_insert(cur->space, node, cur->addr, level, alloc != LOOKUP_PRESERVE);
     }
 
     if (node && (alloc == LOOKUP_ALLOC || (alloc == LOOKUP_SPLIT && node->phy)) && trace_memory_more) {
@@ -434,6 +1162,33 @@ page_lookup_virtual(struct Page *node, uintptr_t addr, int class, int alloc) {
     return node;
 }
 
+/* Lookup virtual address space mapping node with given address and class */
+static struct Page *
+page_lookup_virtual(struct AddressSpace *spc, uintptr_t addr, int class, int alloc) {
+    struct PageCursor cur;
+    cursor_init(&cur, spc);
+    return page_lookup_cursor(&cur, addr, class, alloc);
+}
+
+/*
+ * Returns mapping node containing addr or NULL if addr is not mapped
+ * and sets *next to the end of that mapping or unmapped gap.
+ * Walking a region with it visits every mapping node once
+ */
+static struct Page *
+region_walk(struct PageCursor *cur, uintptr_t addr, uintptr_t *next) {
+    struct Page *node = page_lookup_cursor(cur, addr, 0, LOOKUP_PRESERVE);
+    if (node->phy) {
+        *next = cur->addr + CLASS_SIZE(cur->class);
+        return node;
+    }
+
+    /* Lookup stops at the parent of missing child */
+    int class = cur->class ? cur->class - 1 : 0;
+    *next = ROUNDDOWN(addr, CLASS_SIZE(class)) + CLASS_SIZE(class);
+    return NULL;
+}
+
 static void
 attach_region(uintptr_t start, uintptr_t end, enum PageState type) {
     if (trace_memory_more) cprintf("Attaching memory region [%08lX, %08lX] with type %d\n", start, end - 1, type);
@@ -465,45 +1220,121 @@ attach_region(uintptr_t start, uintptr_t end, enum PageState type) {
     }
 }
 
+/* Removes subtree of node of given class at addr */
 static void
-unmap_page_remove(struct Page *node) {
+unmap_page_remove(struct AddressSpace *spc, struct Page *node, uintptr_t addr, int class) {
     if (!node) return;
     assert_virtual(node);
 
     if (node->phy) {
         assert(!node->left && !node->right);
         assert((node->state & NODE_TYPE_MASK) == MAPPING_NODE);
-        page_unref(node->phy);
+        page_unref(pgptr(node->phy));
     } else {
         assert((node->state & NODE_TYPE_MASK) == INTERMEDIATE_NODE);
-        unmap_page_remove(node->left);
-        unmap_page_remove(node->right);
+        unmap_page_remove(spc, pgptr(node->left), addr, class - 1);
+        unmap_page_remove(spc, pgptr(node->right), addr + CLASS_SIZE(class - 1), class - 1);
     }
 
+    int level = vdir_level(class);
+    if (level >= 0) vdir_remove(spc, node, addr, level);
+
     if (node->parent) {
-        *(node->parent->left == node ?
-                  &node->parent->left :
-                  &node->parent->right) = NULL;
+        struct Page *parent = pgptr(node->parent);
+        maxref_invalidate(parent);
+        *(pgptr(parent->left) == node ?
+                  &parent->left :
+                  &parent->right) = 0;
     }
 
     free_descriptor(node);
 }
 
+/* Unmapped entries are always cleared, so empty table is zeroed */
+inline static bool
+pt_is_empty(pte_t *pt) {
+    for (size_t i = 0; i < PT_ENTRY_COUNT; i++)
+        if (pt[i]) return 0;
+    return 1;
+}
+
+/* Allocates zeroed and referenced page table page */
+static struct Page *
+pt_page_alloc(void) {
+    if (pt_cache.count) {
+        pt_cache_hits++;
+        return pt_cache.pages[--pt_cache.count];
+    }
+
+    pt_cache_misses++;
+    struct Page *page = alloc_page(0, PT_ALLOC_FLAGS | ALLOC_ZERO);
+    if (page) {
+        assert(!page->refc);
+        page_ref(page);
+    }
+    return page;
+}
+
+/* Returns descriptor of page table page */
+static struct Page *
+pt_page(pte_t *pt) {
+    return page_lookup(NULL, (uintptr_t)PADDR(pt), 0, PARTIAL_NODE, 0);
+}
+
+/* Releases page table page. Table should have no present entries */
+static void
+pt_page_free(pte_t *pt) {
+    struct Page *page = pt_page(pt);
+    if (PAGE_IS_UNIQ(page) && pt_cache.count < ZERO_CACHE_SIZE) {
+        if (trace_memory_more) assert(pt_is_empty(pt));
+        pt_cache.pages[pt_cache.count++] = page;
+    } else {
+        page_unref(page);
+    }
+}
+
+/* Makes room for count tables in the cache, so that
+ * tables released by unmapping are reused without allocation */
 static void
+pt_cache_reserve(size_t count) {
+    while (pt_cache.count + count > ZERO_CACHE_SIZE)
+        buddy_unref(pt_cache.pages[--pt_cache.count]);
+}
+
+/* Returns number of released page table pages */
+static size_t
+pt_cache_drain(void) {
+    size_t n = pt_cache.count;
+    while (pt_cache.count) buddy_unref(pt_cache.pages[--pt_cache.count]);
+    return n;
+}
+
+/*
+ * Returns the smallest size of removed pages that might be cached
+ * in TLB (size of entry is returned for removed empty tables,
+ * since paging-structure caches should be invalidated too),
+ * or 0 if no entries were present
+ */
+static size_t
 remove_pt(pte_t *pt, pte_t base, size_t step, uintptr_t i0, uintptr_t i1) {
     assert(step == 1 * GB || step == 2 * MB || step == 4 * KB || step == 512 * GB);
+    size_t granule = 0;
     for (size_t i = i0; i < i1; i++) {
         if (!(pt[i] & PTE_P)) continue;
         assert(!(pt[i] & PTE_PS) || (step == 1 * GB || step == 2 * MB));
 
+        size_t removed = step;
         if (!(pt[i] & PTE_PS) && step > 4 * KB) {
             pte_t *pt2 = KADDR(PTE_ADDR(pt[i]));
-            remove_pt(pt2, base, step / PT_ENTRY_COUNT, 0, PT_ENTRY_COUNT);
-            page_unref(page_lookup(NULL, (uintptr_t)PADDR(pt2), 0, PARTIAL_NODE, 0));
+            size_t inner = remove_pt(pt2, base, step / PT_ENTRY_COUNT, 0, PT_ENTRY_COUNT);
+            if (inner) removed = inner;
+            pt_page_free(pt2);
         }
 
+        granule = granule ? MIN(granule, removed) : removed;
         pt[i] = 0;
     }
+    return granule;
 }
 
 inline static pte_t
@@ -544,21 +1375,22 @@ check_physical_tree(struct Page *page) {
     assert_physical(page);
     assert(page->class >= 0);
     assert(!(page2pa(page) & CLASS_MASK(page->class)));
+    struct Page *left = pgptr(page->left), *right = pgptr(page->right), *parent = pgptr(page->parent);
     if (page->state == ALLOCATABLE_NODE || page->state == RESERVED_NODE) {
-        if (page->left) assert(page->left->state == page->state);
-        if (page->right) assert(page->right->state == page->state);
+        if (left) assert(left->state == page->state);
+        if (right) assert(right->state == page->state);
     }
-    if (page->left) {
-        assert(page->left->class + 1 == page->class);
-        assert(page2pa(page) == page2pa(page->left));
+    if (left) {
+        assert(left->class + 1 == page->class);
+        assert(page2pa(page) == page2pa(left));
     }
-    if (page->right) {
-        assert(page->right->class + 1 == page->class);
-        assert(page->addr + (1ULL << (page->class - 1)) == page->right->addr);
+    if (right) {
+        assert(right->class + 1 == page->class);
+        assert(page2pa(page) + CLASS_SIZE(page->class - 1) == page2pa(right));
     }
-    if (page->parent) {
-        assert(page->parent->class - 1 == page->class);
-        assert((page->parent->left == page) ^ (page->parent->right == page));
+    if (parent) {
+        assert(parent->class - 1 == page->class);
+        assert((pgptr(parent->left) == page) ^ (pgptr(parent->right) == page));
     } else {
         assert(page->class == MAX_CLASS);
         assert(page == &root);
@@ -566,26 +1398,26 @@ check_physical_tree(struct Page *page) {
     if (!page->refc) {
         assert(page->head.next && page->head.prev);
         if (!list_empty((struct List *)page)) {
-            for (struct List *n = page->head.next;
-                 n != &free_classes[page->class]; n = n->next) {
+            for (struct List *n = listptr(page->head.next);
+                 n != page_free_list(page); n = listptr(n->next)) {
                 assert(n != &page->head);
             }
         }
     } else {
-        for (struct List *n = (struct List *)page->head.next;
-             (struct List *)page != n; n = n->next) {
+        for (struct List *n = listptr(page->head.next);
+             (struct List *)page != n; n = listptr(n->next)) {
             struct Page *v = (struct Page *)n;
             assert_virtual(v);
-            assert(v->phy == page);
+            assert(pgptr(v->phy) == page);
         }
     }
-    if (page->left) {
-        assert(page->left->parent == page);
-        check_physical_tree(page->left);
+    if (left) {
+        assert(pgptr(left->parent) == page);
+        check_physical_tree(left);
     }
-    if (page->right) {
-        assert(page->right->parent == page);
-        check_physical_tree(page->right);
+    if (right) {
+        assert(pgptr(right->parent) == page);
+        check_physical_tree(right);
     }
 }
 
@@ -593,24 +1425,24 @@ static void
 check_virtual_tree(struct Page *page, int class) {
     assert(class >= 0);
     assert_virtual(page);
+    struct Page *left = pgptr(page->left), *right = pgptr(page->right), *phy = pgptr(page->phy);
     if ((page->state & NODE_TYPE_MASK) == MAPPING_NODE) {
-        assert(page->phy);
+        assert(phy);
         assert(!(page->state & PROT_LAZY) || !(page->state & PROT_SHARE));
-        assert(!page->left && !page->right);
-        assert(page->phy);
-        if (!(page->phy->class == class)) cprintf("%d %d\n", page->phy->class, class);
-        assert(page->phy->class == class);
+        assert(!left && !right);
+        if (!(phy->class == class)) cprintf("%d %d\n", phy->class, class);
+        assert(phy->class == class);
     } else {
-        assert(!page->phy);
+        assert(!phy);
         assert(page->state == INTERMEDIATE_NODE);
     }
-    if (page->left) {
-        assert(page->left->parent == page);
-        check_virtual_tree(page->left, class - 1);
+    if (left) {
+        assert(pgptr(left->parent) == page);
+        check_virtual_tree(left, class - 1);
     }
-    if (page->right) {
-        assert(page->right->parent == page);
-        check_virtual_tree(page->right, class - 1);
+    if (right) {
+        assert(pgptr(right->parent) == page);
+        check_virtual_tree(right, class - 1);
     }
 }
 
@@ -623,16 +1455,17 @@ dump_virtual_tree(struct Page *node, int class) {
     for (int i = MAX_CLASS; i != class; i--)
            cprintf(" ");
     if ((node->state & NODE_TYPE_MASK) == MAPPING_NODE) {
-        cprintf("Mapping to %lx, class %d\n", (long unsigned)node->phy->addr, node->phy->class);
+        struct Page *phy = pgptr(node->phy);
+        cprintf("Mapping to %lx, class %d\n", (long unsigned)page2pa(phy), phy->class);
     } else {
         cprintf("Intermidiate page, class %d\n", class);
     }
 
     if (node->left) {
-        dump_virtual_tree(node->left, class - 1);
+        dump_virtual_tree(pgptr(node->left), class - 1);
     }
     if (node->right) {
-        dump_virtual_tree(node->right, class - 1);
+        dump_virtual_tree(pgptr(node->right), class - 1);
     }
 }
 
@@ -642,21 +1475,75 @@ dump_memory_lists(void) {
     struct List *li = NULL;
     struct Page *peer = NULL;
 
-    cprintf("Free pages:\nClass   Page adresses\n");
-    for (int pclass = 0; pclass < MAX_CLASS; pclass++, li = NULL) {
-        if (free_classes[pclass].next == &free_classes[pclass]) {
-            continue;
-        }
-        cprintf("%2d      ", pclass);
-
-        int cnt = 1;
-        for (li = free_classes[pclass].next; li != &free_classes[pclass]; li = li->next, cnt++) {
-            peer = (struct Page *)li;
-            cprintf("%08lX ", (unsigned long)peer->addr << pclass);
-            if (cnt % 8 == 0)
-                cprintf("\n        ");
+    cprintf("Free pages:\nNode  Zone  Class   Page adresses\n");
+    for (int node = 0; node < numa_node_count; node++) {
+        for (int zone = 0; zone < ZONE_COUNT; zone++) {
+            for (int pclass = 0; pclass < MAX_CLASS; pclass++, li = NULL) {
+                struct List *list = &free_classes[node][zone][pclass];
+                if (list_empty(list)) {
+                    continue;
+                }
+                cprintf("%4d  %-4s  %2d      ", node, zone_names[zone], pclass);
+
+                int cnt = 1;
+                for (li = listptr(list->next); li != list; li = listptr(li->next), cnt++) {
+                    peer = (struct Page *)li;
+                    if (page_covered(peer)) continue;
+                    cprintf("%08lX ", (unsigned long)page2pa(peer));
+                    if (cnt % 8 == 0)
+                        cprintf("\n                    ");
+                }
+                cprintf("\n\n");
+            }
         }
-        cprintf("\n\n");
+    }
+
+    for (int i = 0; i < NCPU; i++)
+        cprintf("CPU %d magazine: %zu pages\n", i, magazines[i].count);
+}
+
+void
+dump_memory_stats(void) {
+    size_t empty = 0;
+    for (struct PagePool *pool = first_pool; pool; pool = pool->next)
+        empty += !pool->used;
+
+    size_t used = total_desc_count - free_desc_count;
+    cprintf("Page descriptors (%zu bytes each):\n", sizeof(struct Page));
+    cprintf("  used %zu (%zu bytes), peak %zu (%zu bytes), free %zu\n",
+            used, used * sizeof(struct Page),
+            peak_desc_count, peak_desc_count * sizeof(struct Page), free_desc_count);
+    cprintf("Descriptor pools (%zu descriptors each):\n", (size_t)POOL_DESCR);
+    cprintf("  allocated %zu (%zu empty), peak %zu, released %zu\n",
+            pool_count, empty, peak_pool_count, reclaimed_pool_count);
+
+    cprintf("Pre-zeroed pages:\n");
+    for (int class = 0; class <= MAX_ALLOCATION_CLASS; class++)
+        if (zero_cache_target[class])
+            cprintf("  class %d: %zu/%zu\n", class, zero_caches[class].count, zero_cache_target[class]);
+    cprintf("  hits %zu, misses %zu\n", zero_cache_hits, zero_cache_misses);
+    cprintf("Compaction: %zu blocks formed, %zu pages migrated\n", compacted_count, migrated_count);
+    cprintf("Promotion: %zu huge pages formed (%zu with migration)\n", promoted_count, promoted_copy_count);
+    cprintf("Page tables: %zu reclaimed, %zu allocations served from cache, %zu past it (%zu cached)\n",
+            pt_reclaimed_count, pt_cache_hits, pt_cache_misses, pt_cache.count);
+    cprintf("Lazy faults: %zu resolved, %zu mappings allocated around them\n", lazy_fault_count, fault_around_count);
+    cprintf("TLB: %zu full flushes, %zu pages invalidated selectively\n", tlb_flush_count, tlb_invlpg_count);
+    cprintf("Virtual tree: %zu nodes visited by lookups, %zu lookups started from %zu radix directories\n",
+            lookup_steps, vdir_hits, vdir_count);
+
+    cprintf("NUMA nodes (local %d, %zu allocations missed preferred node):\n", numa_local_node, numa_miss_count);
+    for (int node = 0; node < numa_node_count; node++) {
+        cprintf("  node %d: allocated %zu pages, free", node, numa_alloc_count[node]);
+        for (int zone = 0; zone < ZONE_COUNT; zone++) {
+            size_t free = 0;
+            for (int class = 0; class < MAX_CLASS; class++) {
+                struct List *list = &free_classes[node][zone][class];
+                for (struct List *li = listptr(list->next); li != list; li = listptr(li->next))
+                    if (!page_covered((struct Page *)li)) free += CLASS_SIZE(class);
+            }
+            cprintf(" %s %zuK", zone_names[zone], free / 1024);
+        }
+        cprintf("\n");
     }
 }
 
@@ -705,54 +1592,20 @@ dump_page_table(pte_t *pml4) {
 inline static int
 alloc_pt(pte_t *dst) {
     if (!(*dst & PTE_P) || (*dst & PTE_PS)) {
-        struct Page *page = alloc_page(0, ALLOC_BOOTMEM);
+        struct Page *page = pt_page_alloc();
         if (!page) return -E_NO_MEM;
 #ifdef SANITIZE_SHADOW_BASE
         assert(page2pa(page) + CLASS_SIZE(page->class) <= BOOT_MEM_SIZE);
 #endif
-        assert(!page->refc);
-        page_ref(page);
         *dst = page2pa(page) | PTE_U | PTE_W | PTE_P;
 
 #ifdef SANITIZE_SHADOW_BASE
         if (current_space) platform_asan_unpoison(KADDR(page2pa(page)), CLASS_SIZE(0));
 #endif
-        memset(KADDR(page2pa(page)), 0, CLASS_SIZE(0));
     }
     return 0;
 }
 
-static void
-propagate_one_pml4(struct AddressSpace *dst, struct AddressSpace *src) {
-    /* Reference level 3 page tables */
-    for (size_t i = NUSERPML4; i < PML4_ENTRY_COUNT; i++) {
-        if (src->pml4[i] & PTE_P && i != PML4_INDEX(UVPT))
-            page_ref(page_lookup(NULL, PTE_ADDR(src->pml4[i]), 0, PARTIAL_NODE, 0));
-    }
-
-    /* Dereference old level 3 page tables */
-    for (size_t i = NUSERPML4; i < PML4_ENTRY_COUNT; i++) {
-        if (dst->pml4[i] & PTE_P && i != PML4_INDEX(UVPT))
-            page_ref(page_lookup(NULL, PTE_ADDR(dst->pml4[i]), 0, PARTIAL_NODE, 0));
-    }
-
-    pte_t uvpt = dst->pml4[PML4_INDEX(UVPT)];
-    memcpy(dst->pml4 + NUSERPML4, src->pml4 + NUSERPML4,
-           PAGE_SIZE - NUSERPML4 * sizeof(pml4e_t));
-    dst->pml4[PML4_INDEX(UVPT)] = uvpt;
-}
-
-static void
-propagate_pml4(struct AddressSpace *spc) {
-    if (!current_space) return;
-
-    if (spc != &kspace) propagate_one_pml4(&kspace, spc);
-    for (size_t i = 0; i < NENV; i++) {
-        if (envs[i].env_status != ENV_FREE && &envs[i].address_space != spc)
-            propagate_one_pml4(&envs[i].address_space, spc);
-    }
-}
-
 inline static int
 alloc_fill_pt(pte_t *dst, pte_t base, size_t step, size_t i0, size_t i1) {
     assert(i0 != i1);
@@ -765,7 +1618,7 @@ alloc_fill_pt(pte_t *dst, pte_t base, size_t step, size_t i0, size_t i1) {
         if (need_recur) {
             int res = alloc_pt(dst + i);
             if (res < 0) return res;
-            res = alloc_fill_pt(dst + i, base, step / PT_ENTRY_COUNT, 0, PT_ENTRY_COUNT);
+            res = alloc_fill_pt(KADDR(PTE_ADDR(dst[i])), base, step / PT_ENTRY_COUNT, 0, PT_ENTRY_COUNT);
             if (res < 0) return res;
         } else {
             if ((PTE_ADDR(base) & (step - 1))) cprintf("%08lX %08lX\n", (long)PTE_ADDR(base), step);
@@ -777,6 +1630,114 @@ alloc_fill_pt(pte_t *dst, pte_t base, size_t step, size_t i0, size_t i1) {
     return 0;
 }
 
+/* Flushes whole TLB including global entries of all PCIDs */
+static void
+tlb_flush_global(void) {
+    uint64_t cr4 = rcr4();
+    if (cr4 & CR4_PGE) {
+        lcr4(cr4 & ~CR4_PGE);
+        lcr4(cr4);
+    } else {
+        /* CR3 load only flushes current PCID, so other PCIDs
+         * are flushed when reassigned within new generation */
+        if (pcid_supported) {
+            pcid_generation++;
+            pcid_next = 1;
+        }
+        lcr3(rcr3());
+    }
+}
+
+/*
+ * Invalidates gathered ranges. Every range can be invalidated with
+ * one invlpg per its granule, since invlpg drops all entries
+ * of the page containing the address. If that takes too many
+ * instructions whole TLB is flushed instead
+ */
+static void
+tlb_gather_flush(void) {
+    struct TlbGather *tlb = &tlb_gather;
+    if (!tlb->count && !tlb->overflow) return;
+
+    size_t cost = 0;
+    for (size_t i = 0; i < tlb->count && cost <= TLB_FLUSH_THRESHOLD; i++) {
+        struct TlbRange *range = &tlb->ranges[i];
+        cost += (range->end - range->start) / range->granule;
+    }
+
+    if (tlb->overflow || cost > TLB_FLUSH_THRESHOLD) {
+        tlb->global ? tlb_flush_global() : lcr3(rcr3());
+        tlb_flush_count++;
+    } else {
+        for (size_t i = 0; i < tlb->count; i++) {
+            struct TlbRange *range = &tlb->ranges[i];
+            for (uintptr_t va = range->start; va < range->end; va += range->granule)
+                invlpg((void *)va);
+        }
+        tlb_invlpg_count += cost;
+    }
+
+    tlb->count = 0;
+    tlb->global = 0;
+    tlb->overflow = 0;
+}
+
+/* Invalidations are deferred until the outermost tlb_gather_end() */
+static void
+tlb_gather_begin(void) {
+    tlb_gather.depth++;
+}
+
+static void
+tlb_gather_end(void) {
+    assert(tlb_gather.depth > 0);
+    if (!--tlb_gather.depth) tlb_gather_flush();
+}
+
+/*
+ * Invalidates translations of [start, end) that were
+ * removed from spc with pages not smaller than granule
+ * (nothing is done if granule is 0)
+ */
+static void
+tlb_invalidate_range(struct AddressSpace *spc, uintptr_t start, uintptr_t end, size_t granule) {
+    if (!granule) return;
+
+    /* Kernel half is shared by all address spaces and mapped with PTE_G,
+     * so it is cached regardless of the current space */
+    bool global = spc == &kspace && end - 1 >= MAX_USER_ADDRESS;
+
+    /* Stale entries of other address spaces are dropped
+     * when they are loaded with new PCID */
+    if (current_space && current_space != spc) {
+        spc->pcid_gen = 0;
+        if (!global) return;
+    }
+
+    /* Freed kernel tables might be cached for any PCID, and only
+     * global flush drops them, so large kernel ranges are accounted
+     * per 4K page to get whole TLB flushed */
+    if (global) granule = PAGE_SIZE;
+
+    struct TlbGather *tlb = &tlb_gather;
+    struct TlbRange *last = tlb->count ? &tlb->ranges[tlb->count - 1] : NULL;
+    tlb->global |= global;
+    if (end <= start) {
+        /* Range extends up to the end of address space */
+        tlb->overflow = 1;
+    } else if (last && start <= last->end && last->start <= end) {
+        last->start = MIN(last->start, start);
+        last->end = MAX(last->end, end);
+        last->granule = MIN(last->granule, granule);
+    } else if (tlb->count < TLB_GATHER_RANGES) {
+        tlb->ranges[tlb->count++] = (struct TlbRange){start, end, granule};
+    } else {
+        tlb->overflow = 1;
+    }
+
+    if (!tlb->depth) tlb_gather_flush();
+}
+
 /* Copy physical page contents to some virtual address
  *
  * To copy physical address you can use linear
@@ -799,6 +1760,8 @@ memcpy_page(struct AddressSpace *dst, uintptr_t va, struct Page *page) {
     // LAB 7: Your code here
     struct AddressSpace *old = switch_address_space(dst);
 
+    /* Old translation of va might be still pending invalidation */
+    tlb_gather_flush();
     set_wp(0);
     nosan_memcpy((void *)va, KADDR(page2pa(page)), CLASS_SIZE(page -> class));
     set_wp(1);
@@ -806,45 +1769,511 @@ memcpy_page(struct AddressSpace *dst, uintptr_t va, struct Page *page) {
     switch_address_space(old);
 }
 
-static void
-tlb_invalidate_range(struct AddressSpace *spc, uintptr_t start, uintptr_t end) {
-    if (current_space == spc || !current_space) {
-        /* If we need to invalidate a lot of memory, just flush whole cache */
-        if (start - end > 512 * GB)
-            lcr3(rcr3());
-        else {
-            while (start < end) {
-                invlpg((void *)start);
-                start += PAGE_SIZE;
+/* Releases table referenced by the entry if it has no present entries */
+static bool
+reclaim_one_pt(pte_t *entry) {
+    if (!(*entry & PTE_P) || *entry & PTE_PS) return 0;
+
+    pte_t *pt = KADDR(PTE_ADDR(*entry));
+    if (!pt_is_empty(pt)) return 0;
+
+    *entry = 0;
+    pt_page_free(pt);
+    pt_reclaimed_count++;
+    return 1;
+}
+
+/*
+ * Releases page tables on the path to addr that became empty
+ * after unmapping. Kernel part of address spaces is shared
+ * between all of them, so it is never released.
+ * Returns whether any table was released
+ */
+static bool
+reclaim_pt(struct AddressSpace *spc, uintptr_t addr) {
+    if (spc == &kspace || PML4_INDEX(addr) >= NUSERPML4) return 0;
+
+    pml4e_t *pml4e = spc->pml4 + PML4_INDEX(addr);
+    if (!(*pml4e & PTE_P)) return 0;
+    pdpe_t *pdpe = (pdpe_t *)KADDR(PTE_ADDR(*pml4e)) + PDP_INDEX(addr);
+
+    bool reclaimed = 0;
+    if (*pdpe & PTE_P && !(*pdpe & PTE_PS)) {
+        pde_t *pde = (pde_t *)KADDR(PTE_ADDR(*pdpe)) + PD_INDEX(addr);
+        if (!(reclaimed = reclaim_one_pt(pde)) && *pde & PTE_P) return 0;
+    }
+    if (reclaim_one_pt(pdpe)) reclaimed = 1;
+    else if (*pdpe & PTE_P) return reclaimed;
+    return reclaim_one_pt(pml4e) || reclaimed;
+}
+
+/*
+ * Metadata-light address spaces have no virtual tree. Every mapping
+ * is described by page table entries covering it, with flags and
+ * class of the mapped page stored in ignored bits (see light_pte()),
+ * and holds one reference of the physical page. Mapped page is found
+ * in physical tree by its address. Such mappings are not linked into
+ * reverse map, so their pages are never migrated by compaction
+ */
+
+/* Mapping of metadata-light address space decoded from page table */
+struct LightMapping {
+    uintptr_t addr; /* Start of the mapping */
+    physaddr_t pa;  /* Address of the mapped page */
+    int class;
+    int prot;
+    int shares; /* Number of other spaces sharing tables on the path */
+};
+
+/* Returns software bits of page table entries of light mapping */
+inline static pte_t
+light_pte(int flags, int class) {
+    static_assert(!((PTE_LIGHT_LAZY | (0x3FULL << PTE_LIGHT_CLASS_SHIFT)) & ~PTE_IGNORED), "Light PTE bits should be ignored by MMU");
+    static_assert(MAX_CLASS <= 0x3F, "Class should fit into light PTE bits");
+
+    pte_t res = (pte_t)class << PTE_LIGHT_CLASS_SHIFT;
+    if (flags & PROT_R) res |= PTE_LIGHT_R;
+    if (flags & PROT_W) res |= PTE_LIGHT_W;
+    if (flags & PROT_X) res |= PTE_LIGHT_X;
+    if (flags & PROT_LAZY) res |= PTE_LIGHT_LAZY;
+    return res;
+}
+
+/* Restores protection flags of light mapping from its entry */
+inline static int
+light_prot(pte_t pte) {
+    int res = pte & (PROT_AVAIL | PTE_PCD | PTE_PWT);
+    if (pte & PTE_U) res |= PROT_USER_;
+    if (pte & PTE_SHARE) res |= PROT_SHARE;
+    if (pte & PTE_LIGHT_R) res |= PROT_R;
+    if (pte & PTE_LIGHT_W) res |= PROT_W;
+    if (pte & PTE_LIGHT_X) res |= PROT_X;
+    if (pte & PTE_LIGHT_LAZY) res |= PROT_LAZY;
+    return res;
+}
+
+/*
+ * Decodes light mapping containing user address va.
+ * Returns 0 if va is not mapped. *next is set
+ * to the end of the mapping or unmapped gap
+ */
+static bool
+light_lookup(struct AddressSpace *spc, uintptr_t va, struct LightMapping *map, uintptr_t *next) {
+    assert(spc->light && va < MAX_USER_ADDRESS);
+
+    pte_t *table = spc->pml4, entry;
+    size_t size = 512 * GB;
+    bool protected = 0;
+    map->shares = 0;
+    for (;; size /= PT_ENTRY_COUNT) {
+        entry = table[(va / size) % PT_ENTRY_COUNT];
+        if (!(entry & PTE_P)) {
+            *next = ROUNDDOWN(va, size) + size;
+            return 0;
+        }
+        if (size == 4 * KB || entry & PTE_PS) break;
+        table = KADDR(PTE_ADDR(entry));
+        if (!(entry & PTE_W)) {
+            protected = 1;
+            map->shares += pt_page(table)->refc - 1;
+        }
+    }
+
+    map->class = PTE_LIGHT_CLASS(entry);
+    map->addr = ROUNDDOWN(va, CLASS_SIZE(map->class));
+    map->pa = PTE_ADDR(entry) + (va & (size - 1)) - (va - map->addr);
+    map->prot = light_prot(entry);
+    /* Pages of shared tables are copied on write */
+    if (protected && !(map->prot & PROT_SHARE)) map->prot |= PROT_LAZY;
+    *next = map->addr + CLASS_SIZE(map->class);
+    return 1;
+}
+
+/* Returns physical page of light mapping */
+static struct Page *
+light_phy(struct LightMapping *map) {
+    struct Page *phy = page_lookup(NULL, map->pa, map->class, PARTIAL_NODE, 0);
+    assert(phy && phy->refc);
+    return phy;
+}
+
+/* Returns page of light mapping whose first entry is pte */
+static struct Page *
+light_head_phy(pte_t pte) {
+    struct Page *phy = page_lookup(NULL, PTE_ADDR(pte), PTE_LIGHT_CLASS(pte), PARTIAL_NODE, 0);
+    assert(phy && phy->refc);
+    return phy;
+}
+
+/*
+ * Page tables of light spaces can be shared (see light_share()).
+ * Shared table holds one reference of every table and page it points to,
+ * and its reference count is the number of entries pointing to it. Such
+ * entries are write-protected, so writes through them fault, and the table
+ * is made private to the space by light_unshare_pt() before any change.
+ */
+
+/*
+ * Makes table referenced by write-protected entry of given size private.
+ * Shared table is copied, and since pages and tables referenced by it
+ * become shared by both copies, pages are marked lazy and table entries
+ * are write-protected in both of them (this only adds protection to the
+ * spaces still sharing the original table, which can't write it anyway).
+ * Returns 1 if entry was changed
+ */
+static int
+light_unshare_pt(struct AddressSpace *spc, pte_t *entry, uintptr_t base, size_t size) {
+    if (*entry & PTE_W) return 0;
+
+    pte_t *pt = KADDR(PTE_ADDR(*entry));
+    struct Page *page = pt_page(pt);
+    if (page->refc > 1) {
+        struct Page *copy = pt_page_alloc();
+        if (!copy) return -E_NO_MEM;
+
+        size_t step = size / PT_ENTRY_COUNT;
+        for (size_t i = 0; i < PT_ENTRY_COUNT; i++) {
+            if (!(pt[i] & PTE_P)) continue;
+            if (step > 4 * KB && !(pt[i] & PTE_PS)) {
+                page_ref(pt_page(KADDR(PTE_ADDR(pt[i]))));
+                pt[i] &= ~PTE_W;
+            } else {
+                if (!(pt[i] & PTE_SHARE)) pt[i] = (pt[i] & ~PTE_W) | PTE_LIGHT_LAZY;
+                if (!((base + i * step) & CLASS_MASK(PTE_LIGHT_CLASS(pt[i]))))
+                    page_ref(light_head_phy(pt[i]));
             }
         }
+        memcpy(KADDR(page2pa(copy)), pt, PAGE_SIZE);
+        page_unref(page);
+        *entry = page2pa(copy) | (*entry & ~PTE_ADDR(*entry));
+    }
+    *entry |= PTE_W;
+
+    /* Paging structure caches can still hold the original table */
+    tlb_invalidate_range(spc, base, base + size, size);
+    return 1;
+}
+
+/* Makes tables covering [start, end) of given table with entries
+ * of given size private. Returns number of changed entries */
+static int
+light_unshare_table(struct AddressSpace *spc, pte_t *table, uintptr_t base, size_t size, uintptr_t start, uintptr_t end) {
+    int count = 0;
+    if (size == 4 * KB) return 0;
+
+    size_t i0 = (MAX(start, base) - base) / size;
+    size_t i1 = (MIN(end, base + size * PT_ENTRY_COUNT) - base + size - 1) / size;
+    for (size_t i = i0; i < i1; i++) {
+        if (!(table[i] & PTE_P) || table[i] & PTE_PS) continue;
+
+        int res = light_unshare_pt(spc, table + i, base + i * size, size);
+        if (res < 0) return res;
+        count += res;
+
+        res = light_unshare_table(spc, KADDR(PTE_ADDR(table[i])), base + i * size,
+                                  size / PT_ENTRY_COUNT, start, end);
+        if (res < 0) return res;
+        count += res;
     }
+    return count;
 }
 
-static void
-unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
+/* Makes page tables of light space covering [start, end) private */
+static int
+light_unshare(struct AddressSpace *spc, uintptr_t start, uintptr_t end) {
+    assert(start < end && end <= MAX_USER_ADDRESS);
+    return light_unshare_table(spc, spc->pml4, 0, 512 * GB, start, end);
+}
+
+/*
+ * Returns entry of given size covering addr in light space or NULL if there is
+ * no such entry. Tables on the path are made private unless alloc is
+ * LOOKUP_PRESERVE, and missing ones are allocated if it is LOOKUP_ALLOC
+ */
+static pte_t *
+light_walk(struct AddressSpace *spc, uintptr_t addr, size_t size, int alloc) {
+    pte_t *entry = spc->pml4 + PML4_INDEX(addr);
+    for (size_t span = 512 * GB; span > size; span /= PT_ENTRY_COUNT) {
+        if (!(*entry & PTE_P)) {
+            if (alloc != LOOKUP_ALLOC || alloc_pt(entry) < 0) return NULL;
+        } else if (*entry & PTE_PS) {
+            return NULL;
+        } else if (alloc != LOOKUP_PRESERVE && light_unshare_pt(spc, entry, ROUNDDOWN(addr, span), span) < 0) {
+            return NULL;
+        }
+        entry = (pte_t *)KADDR(PTE_ADDR(*entry)) + (addr / (span / PT_ENTRY_COUNT)) % PT_ENTRY_COUNT;
+    }
+    return entry;
+}
+
+/* Fills page table entries of page of given class mapped at addr with base,
+ * allocating page tables and splitting huge pages as required */
+static int
+insert_pt(struct AddressSpace *spc, uintptr_t addr, pte_t base, int class) {
+    uintptr_t end = addr + CLASS_SIZE(class);
+    if (spc->light && light_unshare(spc, addr, end) < 0) return -E_NO_MEM;
+
+    size_t pml4i0 = PML4_INDEX(addr), pml4i1 = PML4_INDEX(end);
+    /* Fill PML4 range if page size is larger than 512GB */
+    if (class >= 27) {
+        return alloc_fill_pt(spc->pml4, base, 512 * GB, pml4i0, pml4i1);
+    }
+
+    /* Allocate empty pdp if required (kernel ones are allocated by init_kspace()) */
+    if (!(spc->pml4[pml4i0] & PTE_P)) {
+        assert(pml4i0 < NUSERPML4);
+        if (alloc_pt(spc->pml4 + pml4i0) < 0) return -E_NO_MEM;
+    }
+    assert(!(spc->pml4[pml4i0] & PTE_PS)); /* There's (yet) no support for 512GB pages in x86 arch */
+    pdpe_t *pdp = KADDR(PTE_ADDR(spc->pml4[pml4i0]));
+
+    /* If requested region is larger than or equal to 1GB (at least one whole PD) */
+
+    size_t pdpi0 = PDP_INDEX(addr), pdpi1 = PDP_INDEX(end);
+    /* Fixup index if pdpi0 == 511 and pdpi1 == 0 (and should be 512) */
+    if (pdpi0 > pdpi1) pdpi1 = PDP_ENTRY_COUNT;
+    /* Fill PDP range if page size is larger than 1GB */
+    if (class >= 18) return alloc_fill_pt(pdp, base, 1 * GB, pdpi0, pdpi1);
+
+    /* Allocate empty pd... */
+    if (!(pdp[pdpi0] & PTE_P) && alloc_pt(pdp + pdpi0) < 0) return -E_NO_MEM;
+    /* ...or split 1GB page into 2MB pages if required */
+    else if (pdp[pdpi0] & PTE_PS) {
+        pdpe_t old = pdp[pdpi0];
+        if (alloc_pt(pdp + pdpi0) < 0) return -E_NO_MEM;
+        pde_t *pd = KADDR(PTE_ADDR(pdp[pdpi0]));
+        if (alloc_fill_pt(pd, old & ~PTE_PS, 2 * MB, 0, PT_ENTRY_COUNT) < 0) return -E_NO_MEM;
+    }
+    /* Calculate kernel virtual address of page directory */
+    pde_t *pd = KADDR(PTE_ADDR(pdp[pdpi0]));
+
+
+    /* If requested region is larger than or equal to 2MB (at least one whole PT) */
+
+    /* Calculate indexes and fill PD range if page size is larger than 2MB */
+
+    // LAB 7: Your code here
+    size_t pdi0 = PD_INDEX(addr), pdi1 = PD_INDEX(end);
+
+    if (pdi0 > pdi1) pdi1 = PD_ENTRY_COUNT;
+    if (class >= 9) return alloc_fill_pt(pd, base, 2 * MB, pdi0, pdi1);
+
+    /* Allocate empty pt or split 2MB page into 4KB pages if required and
+     * calculate virtual address into pt.
+     * alloc_pt(), alloc_fill_pt() are used here.
+     * TIP: Look at the code above doing the same thing for 1GB pages */
+
+    // LAB 7: Your code here
+    if (!(pd[pdi0] & PTE_P) && alloc_pt(pd + pdi0) < 0) return -E_NO_MEM;
+    else if (pd[pdi0] & PTE_PS) {
+        pde_t old = pd[pdi0];
+        if (alloc_pt(pd + pdi0) < 0) return -E_NO_MEM;
+        pte_t *pt = KADDR(PTE_ADDR(pd[pdi0]));
+        if (alloc_fill_pt(pt, old & ~PTE_PS, 4 * KB, 0, PT_ENTRY_COUNT) < 0) return -E_NO_MEM;
+    }
+    pte_t *pt = KADDR(PTE_ADDR(pd[pdi0]));
+
+    /* If requested region is larger than or equal to 4KB (at least one whole page) */
+
+    size_t pti0 = PT_INDEX(addr), pti1 = PT_INDEX(end);
+    if (pti0 > pti1) pti1 = PT_ENTRY_COUNT;
+    /* Fill PT range if page size is larger than 4KB */
+    if (class >= 0) return alloc_fill_pt(pt, base, 4 * KB, pti0, pti1);
+
+    /* We cannot allocate less than a page */
+    assert(0);
+}
+
+/*
+ * Splits light mapping containing addr into halves
+ * until it is not larger than class, like page_lookup_cursor()
+ * does with mapping nodes of virtual tree
+ */
+static int
+light_split(struct AddressSpace *spc, uintptr_t addr, int class) {
+    struct LightMapping map;
+    uintptr_t next;
+    while (light_lookup(spc, addr, &map, &next) && map.class > class) {
+        struct Page *phy = light_phy(&map);
+        if (!page_lookup(phy, map.pa, map.class - 1, PARTIAL_NODE, 1)) return -E_NO_MEM;
+        struct Page *left = pgptr(phy->left), *right = pgptr(phy->right);
+
+        /* Only the first half can require allocation of page table,
+         * so the mapping is left intact if it fails */
+        pte_t base = prot2pte(map.prot) | light_pte(map.prot, map.class - 1);
+        int res = insert_pt(spc, map.addr, page2pa(left) | base, map.class - 1);
+        if (res < 0) return res;
+        res = insert_pt(spc, map.addr + CLASS_SIZE(map.class - 1), page2pa(right) | base, map.class - 1);
+        assert(!res);
+
+        page_ref(left);
+        page_ref(right);
+        page_unref(phy);
+
+        /* Translations of split huge page are the same, but
+         * TLB should not cache them with different page sizes */
+        if (map.class == 9 || map.class == 18)
+            tlb_invalidate_range(spc, map.addr, next, CLASS_SIZE(map.class));
+    }
+    return 0;
+}
+
+static size_t light_drop_table(struct AddressSpace *spc, pte_t *table, uintptr_t base, size_t size);
+
+/*
+ * Removes entries of light mappings within [start, end) from table
+ * with entries of given size starting at base, dropping references
+ * of their pages and tables. Partially covered tables are made private,
+ * mappings partially covered by the range should be split beforehand.
+ * Lowers *granule to minimal size of removed pages like remove_pt().
+ * Fails with -E_NO_MEM if partially covered table cannot be made
+ * private (entries removed before that stay removed)
+ */
+static int
+light_remove(struct AddressSpace *spc, pte_t *table, uintptr_t base, size_t size,
+             uintptr_t start, uintptr_t end, size_t *granule) {
+    size_t i0 = (MAX(start, base) - base) / size;
+    size_t i1 = (MIN(end, base + size * PT_ENTRY_COUNT) - base + size - 1) / size;
+    for (size_t i = i0; i < i1; i++) {
+        pte_t *entry = table + i;
+        uintptr_t va = base + i * size;
+        if (!(*entry & PTE_P)) continue;
+
+        size_t removed = size;
+        int res = 0;
+        if (size == 4 * KB || *entry & PTE_PS) {
+            assert(start <= va && va + size <= end);
+            if (!(va & CLASS_MASK(PTE_LIGHT_CLASS(*entry)))) page_unref(light_head_phy(*entry));
+            *entry = 0;
+        } else if (start <= va && va + size <= end) {
+            removed = light_drop_table(spc, KADDR(PTE_ADDR(*entry)), va, size / PT_ENTRY_COUNT);
+            *entry = 0;
+        } else {
+            removed = 0;
+            res = light_unshare_pt(spc, entry, va, size);
+            if (res >= 0)
+                res = light_remove(spc, KADDR(PTE_ADDR(*entry)), va, size / PT_ENTRY_COUNT, start, end, granule);
+        }
+
+        if (removed) *granule = *granule ? MIN(*granule, removed) : removed;
+        if (res < 0) return res;
+    }
+    return 0;
+}
+
+/* Drops reference of table with entries of given size,
+ * releasing its entries if it is not shared */
+static size_t
+light_drop_table(struct AddressSpace *spc, pte_t *table, uintptr_t base, size_t size) {
+    struct Page *page = pt_page(table);
+    /* Any pages might be cached for the shared table */
+    if (page->refc > 1) {
+        page_unref(page);
+        return PAGE_SIZE;
+    }
+
+    /* Table is covered entirely, so nothing is made private */
+    size_t granule = 0;
+    int res = light_remove(spc, table, base, size, base, base + size * PT_ENTRY_COUNT, &granule);
+    assert(!res);
+    pt_page_free(table);
+    return granule;
+}
+
+/* Unmaps aligned block of given class at addr from light space.
+ * Fails with -E_NO_MEM if mapping or shared table partially
+ * covered by the block cannot be split or made private */
+static int
+light_unmap(struct AddressSpace *spc, uintptr_t addr, int class) {
+    if (addr >= MAX_USER_ADDRESS) return 0;
+    uintptr_t end = MIN(addr + CLASS_SIZE(class), MAX_USER_ADDRESS);
+
+    /* Mapping partially covered by the block should be split first */
+    int res = light_split(spc, addr, class);
+    if (res < 0) return res;
+
+    size_t granule = 0;
+    res = light_remove(spc, spc->pml4, 0, 512 * GB, addr, end, &granule);
+    if (reclaim_pt(spc, addr) && !granule) granule = PAGE_SIZE;
+    tlb_invalidate_range(spc, addr, end, granule);
+    return res;
+}
+
+/*
+ * Returns physical page mapped at addr of tree or light address space
+ * (or NULL if addr is not mapped), sets *prot to protection of the mapping
+ * and *next to the end of the mapping or unmapped gap like region_walk()
+ */
+static struct Page *
+mapping_walk(struct PageCursor *cur, uintptr_t addr, int *prot, uintptr_t *next) {
+    if (cur->space->light) {
+        struct LightMapping map;
+        if (addr >= MAX_USER_ADDRESS) {
+            *next = addr + CLASS_SIZE(0);
+            return NULL;
+        }
+        if (!light_lookup(cur->space, addr, &map, next)) return NULL;
+        *prot = map.prot;
+        return light_phy(&map);
+    }
+
+    struct Page *node = region_walk(cur, addr, next);
+    if (!node) return NULL;
+    *prot = PAGE_PROT(node->state);
+    return pgptr(node->phy);
+}
+
+/* Unmaps page looking up its mapping with cursor
+ * (only unmapping part of light mapping can fail) */
+static int
+do_unmap_page(struct PageCursor *cur, uintptr_t addr, int class) {
+    struct AddressSpace *spc = cur->space;
     if (trace_memory) cprintf("<%p> Unmapping [%08lX, %08lX]\n",
                               spc, addr, addr + (long)CLASS_MASK(class));
     int res;
     assert(!(addr & CLASS_MASK(class)));
 
-    struct Page *node = page_lookup_virtual(spc->root, addr, class, LOOKUP_ALLOC);
-    if (node) unmap_page_remove(node);
+    if (spc->light) return light_unmap(spc, addr, class);
+
+    struct Page *node = page_lookup_cursor(cur, addr, class, LOOKUP_ALLOC);
+    /* Node is freed, so move cursor to its parent */
+    if (node && node->parent) {
+        cur->node = pgptr(node->parent);
+        cur->class = class + 1;
+        cur->addr = ROUNDDOWN(addr, CLASS_SIZE(class + 1));
+    }
+    if (node) unmap_page_remove(spc, node, addr, class);
     /* Disallow root node deallocation */
-    if (node == spc->root)
+    if (node == spc->root) {
+        if (spc != &kspace) space_index_del(spc);
         spc->root = alloc_descriptor(INTERMEDIATE_NODE);
+        if (spc != &kspace) space_index_add(spc);
+        cursor_init(cur, spc);
+    }
 
     uintptr_t end = addr + CLASS_SIZE(class);
-    uintptr_t inval_start = addr, inval_end = end;
+    /* Split huge pages need no separate invalidation: invlpg
+     * of any removed address drops their whole TLB entries */
+    size_t granule = 0;
 
     size_t pml4i0 = PML4_INDEX(addr), pml4i1 = PML4_INDEX(end);
     if (class >= 27) {
-        remove_pt(spc->pml4, addr, 512 * GB, pml4i0, pml4i1);
-        if (pml4i1 - 1 >= NUSERPML4) propagate_pml4(spc);
+        /* Fixup index if range extends up to the end of address space.
+         * Kernel part of user address spaces is not described by
+         * the virtual tree and is released separately */
+        if (pml4i1 <= pml4i0) pml4i1 = PML4_ENTRY_COUNT;
+        if (spc != &kspace) pml4i1 = MIN(pml4i1, NUSERPML4);
+        granule = remove_pt(spc->pml4, addr, 512 * GB, pml4i0, MIN(pml4i1, NUSERPML4));
+        /* Kernel PDPs are shared by all address spaces and never released */
+        for (size_t i = MAX(pml4i0, NUSERPML4); i < pml4i1; i++) {
+            if (i == UVPT_INDEX) continue;
+            size_t removed = remove_pt(KADDR(PTE_ADDR(spc->pml4[i])), addr, 1 * GB, 0, PDP_ENTRY_COUNT);
+            if (removed) granule = granule ? MIN(granule, removed) : removed;
+        }
         goto finish;
     }
 
-    if (!(spc->pml4[pml4i0] & PTE_P)) return;
+    if (!(spc->pml4[pml4i0] & PTE_P)) return 0;
     pdpe_t *pdp = KADDR(PTE_ADDR(spc->pml4[pml4i0]));
 
     size_t pdpi0 = PDP_INDEX(addr), pdpi1 = PDP_INDEX(end);
@@ -856,14 +2285,14 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
      * is >= than 1*GB */
 
     if (class >= 18) {
-        remove_pt(pdp, addr, 1 * GB, pdpi0, pdpi1);
+        granule = remove_pt(pdp, addr, 1 * GB, pdpi0, pdpi1);
         goto finish;
     }
 
     /* If page is not present don't need to do anything */
 
     if (!(pdp[pdpi0] & PTE_P))
-        return;
+        return 0;
     /* otherwise we need to split 1*GB page hw page
      * into smaller 2*MB pages, allocting new page table level */
     else if (pdp[pdpi0] & PTE_PS) {
@@ -872,8 +2301,6 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
         assert(!res);
         pde_t *pd = KADDR(PTE_ADDR(pdp[pdpi0]));
         res = alloc_fill_pt(pd, old & ~PTE_PS, 2 * MB, 0, PT_ENTRY_COUNT);
-        inval_start = ROUNDDOWN(inval_start, 1 * GB);
-        inval_end = ROUNDUP(inval_end, 1 * GB);
         assert(!res);
     }
     pde_t *pd = KADDR(PTE_ADDR(pdp[pdpi0]));
@@ -890,7 +2317,7 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
     size_t pdi0 = PD_INDEX(addr), pdi1 = PD_INDEX(end);
     if (pdi0 > pdi1) pdi1 = PD_ENTRY_COUNT;
     if (class >= 9) {
-        remove_pt(pd, addr, 2 * MB, pdi0, pdi1);
+        granule = remove_pt(pd, addr, 2 * MB, pdi0, pdi1);
         goto finish;
     }
 
@@ -905,15 +2332,13 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
     // LAB 7: Your code here
 
     if (!(pd[pdi0] & PTE_P))
-        return;
+        return 0;
     else if (pd[pdi0] & PTE_PS) {
         pde_t old = pd[pdi0];
         res = alloc_pt(pd + pdi0);
         assert(!res);
         pte_t *pt = KADDR(PTE_ADDR(pd[pdi0]));
         res = alloc_fill_pt(pt, old & ~PTE_PS, 4 * KB, 0, PT_ENTRY_COUNT);
-        inval_start = ROUNDDOWN(inval_start, 2 * MB);
-        inval_end = ROUNDUP(inval_end, 2 * MB);
         assert(!res);
     }
     pte_t *pt = KADDR(PTE_ADDR(pd[pdi0]));;
@@ -922,7 +2347,7 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
     size_t pti0 = PT_INDEX(addr), pti1 = PT_INDEX(end);
     if (pti0 > pti1) pti1 = PT_ENTRY_COUNT;
     if (class >= 0) {
-        remove_pt(pt, addr, 4 * KB, pti0, pti1);
+        granule = remove_pt(pt, addr, 4 * KB, pti0, pti1);
         goto finish;
     }
 
@@ -930,7 +2355,17 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
     assert(0);
 
 finish:
-    tlb_invalidate_range(spc, inval_start, inval_end);
+    /* Whole PML4 entries are released by remove_pt() */
+    if (class < 27 && reclaim_pt(spc, addr) && !granule) granule = PAGE_SIZE;
+    tlb_invalidate_range(spc, addr, end, granule);
+    return 0;
+}
+
+static int
+unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
+    struct PageCursor cur;
+    cursor_init(&cur, spc);
+    return do_unmap_page(&cur, addr, class);
 }
 
 static int
@@ -946,13 +2381,25 @@ map_page(struct AddressSpace *spc, uintptr_t addr, struct Page *page, int flags)
 
     if (!(flags & ALLOC_WEAK)) {
         page_ref(page);
-        unmap_page(spc, addr, page->class);
-        struct Page *mapping = page_lookup_virtual(spc->root, addr, page->class, LOOKUP_ALLOC);
-        if (!mapping) return -E_NO_MEM;
+        int res = unmap_page(spc, addr, page->class);
+        if (res < 0) {
+            page_unref(page);
+            return res;
+        }
+        /* Light mappings are described by page table entries alone */
+        assert(!spc->light || addr < MAX_USER_ADDRESS);
+        if (!spc->light) {
+            struct Page *mapping = page_lookup_virtual(spc, addr, page->class, LOOKUP_ALLOC);
+            if (!mapping) {
+                page_unref(page);
+                return -E_NO_MEM;
+            }
 
-        mapping->phy = page;
-        mapping->state = (PAGE_PROT(flags) & ~PROT_COMBINE) | MAPPING_NODE;
-        list_append((struct List *)page, (struct List *)mapping);
+            mapping->phy = pglink(page);
+            mapping->state = (PAGE_PROT(flags) & ~PROT_COMBINE) | MAPPING_NODE;
+            list_append((struct List *)page, (struct List *)mapping);
+            maxref_invalidate(mapping);
+        }
     }
 
     if (trace_memory) cprintf("<%p> Mapping [%08lX, %08lX] to [%08lX, %08lX] (class=%d flags=%x)\n", spc,
@@ -961,185 +2408,722 @@ map_page(struct AddressSpace *spc, uintptr_t addr, struct Page *page, int flags)
 
     /* Insert page into page table */
 
-    uintptr_t end = addr + CLASS_SIZE(page->class);
-    uintptr_t base = page2pa(page) | prot2pte(flags);
+    pte_t base = page2pa(page) | prot2pte(flags);
     assert(!(page2pa(page) & CLASS_MASK(page->class)));
+    /* Kernel half is the same in every address space */
+    if (spc == &kspace && addr >= MAX_USER_ADDRESS && pge_supported) base |= PTE_G;
+    if (spc->light) base |= light_pte(flags, page->class);
 
-    size_t pml4i0 = PML4_INDEX(addr), pml4i1 = PML4_INDEX(end);
-    /* Fill PML4 range if page size is larger than 512GB */
-    if (page->class >= 27) {
-        int res = alloc_fill_pt(spc->pml4, base, 512 * GB, pml4i0, pml4i1);
-        if (pml4i1 - 1 >= NUSERPML4) propagate_pml4(spc);
-        return res;
+    return insert_pt(spc, addr, base, page->class);
+}
+
+int
+unmap_region(struct AddressSpace *dspace, uintptr_t dst, uintptr_t size) {
+    int class = 0, res = 0;
+
+    uintptr_t start = ROUNDDOWN(dst, 1ULL << CLASS_BASE);
+    uintptr_t end = ROUNDUP(dst + size, 1ULL << CLASS_BASE);
+
+    /* Adjacent pages are unmapped, so lookups are sped up with cursor */
+    struct PageCursor cur;
+    cursor_init(&cur, dspace);
+    tlb_gather_begin();
+
+    for (; !res && class < MAX_CLASS && start + CLASS_SIZE(class) <= end; class ++) {
+        if (start & CLASS_SIZE(class)) {
+            res = do_unmap_page(&cur, start, class);
+            start += CLASS_SIZE(class);
+        }
     }
 
-    /* Allocate empty pdp if required */
-    if (!(spc->pml4[pml4i0] & PTE_P)) {
-        if (alloc_pt(spc->pml4 + pml4i0) < 0) return -E_NO_MEM;
-        if (pml4i0 >= NUSERPML4) propagate_pml4(spc);
+    for (; !res && class >= 0 && start < end; class --) {
+        if (start + CLASS_SIZE(class) <= end) {
+            res = do_unmap_page(&cur, start, class);
+            start += CLASS_SIZE(class);
+        }
     }
-    assert(!(spc->pml4[pml4i0] & PTE_PS)); /* There's (yet) no support for 512GB pages in x86 arch */
-    pdpe_t *pdp = KADDR(PTE_ADDR(spc->pml4[pml4i0]));
 
-    /* If requested region is larger than or equal to 1GB (at least one whole PD) */
+    tlb_gather_end();
+    reclaim_pools();
+    return res;
+}
 
-    size_t pdpi0 = PDP_INDEX(addr), pdpi1 = PDP_INDEX(end);
-    /* Fixup index if pdpi0 == 511 and pdpi1 == 0 (and should be 512) */
-    if (pdpi0 > pdpi1) pdpi1 = PDP_ENTRY_COUNT;
-    /* Fill PDP range if page size is larger than 1GB */
-    if (page->class >= 18) return alloc_fill_pt(pdp, base, 1 * GB, pdpi0, pdpi1);
+/* Allocate page from the buddy tree preferring given NUMA node */
+static struct Page *
+buddy_alloc_page(int class, int flags, int node) {
+    struct List *li = NULL;
+    struct Page *peer = NULL;
 
-    /* Allocate empty pd... */
-    if (!(pdp[pdpi0] & PTE_P) && alloc_pt(pdp + pdpi0) < 0) return -E_NO_MEM;
-    /* ...or split 1GB page into 2MB pages if required */
-    else if (pdp[pdpi0] & PTE_PS) {
-        pdpe_t old = pdp[pdpi0];
-        if (alloc_pt(pdp + pdpi0) < 0) return -E_NO_MEM;
-        pde_t *pd = KADDR(PTE_ADDR(pdp[pdpi0]));
-        if (alloc_fill_pt(pd, old & ~PTE_PS, 2 * MB, 0, PT_ENTRY_COUNT) < 0) return -E_NO_MEM;
+    /* Find page that is not smaller than requested
+     * (Pool memory should also be within BOOT_MEM_SIZE).
+     * Zones are tried starting from the least precious one
+     * that satisfies constraints and every page in zone except
+     * for the one starting at 0 lies entirely within the zone,
+     * so at most one page per free list is skipped.
+     * Other NUMA nodes are only tried when preferred one
+     * does not have suitable memory */
+    enum MemoryZone zone = flags & ALLOC_DMA     ? ZONE_DMA :
+                           flags & ALLOC_BOOTMEM ? ZONE_BOOT :
+                                                   ZONE_HIGH;
+    physaddr_t limit = zone_limits[zone];
+retry:
+    for (int i = 0; i < numa_node_count; i++) {
+        for (int z = zone; z >= 0; z--) {
+            for (int pclass = class; pclass < MAX_CLASS; pclass++, li = NULL) {
+                struct List *list = &free_classes[(node + i) % numa_node_count][z][pclass];
+                for (li = listptr(list->next); li != list; li = listptr(li->next)) {
+                    peer = (struct Page *)li;
+                    assert(peer->state == ALLOCATABLE_NODE);
+                    assert_physical(peer);
+                    if (page2pa(peer) + CLASS_SIZE(class) <= limit) goto found;
+                }
+            }
+        }
     }
-    /* Calculate kernel virtual address of page directory */
-    pde_t *pd = KADDR(PTE_ADDR(pdp[pdpi0]));
+    return NULL;
 
+found:
+    /* Pages referenced as a part of bigger page are
+     * left in free lists until the reference is pushed down */
+    if (page_covered(peer)) {
+        page_push_path(peer);
+        assert(peer->refc && list_empty(li));
+        goto retry;
+    }
 
-    /* If requested region is larger than or equal to 2MB (at least one whole PT) */
+    int pnode = pa_node(page2pa(peer));
+    numa_alloc_count[pnode]++;
+    if (pnode != node) numa_miss_count++;
 
-    /* Calculate indexes and fill PD range if page size is larger than 2MB */
+    list_del(li);
 
-    // LAB 7: Your code here
-    size_t pdi0 = PD_INDEX(addr), pdi1 = PD_INDEX(end);
+    if (flags & ALLOC_POOL) {
+        assert(!allocating_pool);
+        allocating_pool = 1;
+    }
 
-    if (pdi0 > pdi1) pdi1 = PD_ENTRY_COUNT;
-    if (page->class >= 9) return alloc_fill_pt(pd, base, 2 * MB, pdi0, pdi1);
+    struct Page *new = page_lookup(peer, page2pa(peer), class, PARTIAL_NODE, 1);
+    assert(!new->refc);
 
-    /* Allocate empty pt or split 2MB page into 4KB pages if required and
-     * calculate virtual address into pt.
-     * alloc_pt(), alloc_fill_pt() are used here.
-     * TIP: Look at the code above doing the same thing for 1GB pages */
+    if (flags & ALLOC_POOL) {
+#ifdef SANITIZE_SHADOW_BASE
+        assert(page2pa(new) + CLASS_SIZE(new->class) <= BOOT_MEM_SIZE);
+#endif
+        page_ref(new);
 
-    // LAB 7: Your code here
-    if (!(pd[pdi0] & PTE_P) && alloc_pt(pd + pdi0) < 0) return -E_NO_MEM;
-    else if (pd[pdi0] & PTE_PS) {
-        pde_t old = pd[pdi0];
-        if (alloc_pt(pd + pdi0) < 0) return -E_NO_MEM;
-        pte_t *pt = KADDR(PTE_ADDR(pd[pdi0]));
-        if (alloc_fill_pt(pt, old & ~PTE_PS, 4 * KB, 0, PT_ENTRY_COUNT) < 0) return -E_NO_MEM;
+        /* Descriptors of the new pool become available only after
+         * the pool page is split off, so pool itself is always
+         * described by descriptors from other pools and can
+         * be released once it becomes empty */
+        struct PagePool *newpool = KADDR(page2pa(new));
+#ifdef SANITIZE_SHADOW_BASE
+        /* Need to unpoison early to initiallize lists inplace */
+        if (current_space) platform_asan_unpoison(newpool, CLASS_SIZE(class));
+#endif
+        add_pool(newpool, new);
+        newpool->next = first_pool;
+        first_pool = newpool;
+        peak_pool_count = MAX(peak_pool_count, ++pool_count);
+        allocating_pool = 0;
+
+        if (trace_memory_more) cprintf("Allocated pool of size %zu at [%08lX, %08lX]\n",
+                                       (size_t)POOL_DESCR, page2pa(new), page2pa(new) + (long)CLASS_MASK(class));
+    } else {
+        if (trace_memory_more) cprintf("Allocated page at [%08lX, %08lX] class=%d\n",
+                                       page2pa(new), page2pa(new) + (long)CLASS_MASK(new->class), new->class);
     }
-    pte_t *pt = KADDR(PTE_ADDR(pd[pdi0]));
 
-    /* If requested region is larger than or equal to 4KB (at least one whole page) */
+    assert(page2pa(new) >= PADDR(end) || page2pa(new) + CLASS_MASK(new->class) < IOPHYSMEM);
 
-    size_t pti0 = PT_INDEX(addr), pti1 = PT_INDEX(end);
-    if (pti0 > pti1) pti1 = PT_ENTRY_COUNT;
-    /* Fill PT range if page size is larger than 4KB */
-    if (page->class >= 0) return alloc_fill_pt(pt, base, 4 * KB, pti0, pti1);
+    return new;
+}
 
-    /* We cannot allocate less than a page */
-    assert(0);
+/*
+ * Allocates 4K page from magazine refilling
+ * it from the buddy tree if it is empty
+ */
+static struct Page *
+magazine_alloc(void) {
+    struct PageMagazine *mag = this_magazine();
+
+    if (!mag->count) {
+        while (mag->count < MAGAZINE_BATCH) {
+            struct Page *page = buddy_alloc_page(0, 0, numa_local_node);
+            if (!page) break;
+            page_ref(page);
+            mag->pages[mag->count++] = page;
+        }
+        if (!mag->count) return NULL;
+    }
+
+    struct Page *page = mag->pages[--mag->count];
+    assert(page->refc == 1 && !page->left && !page->right);
+    assert(list_empty((struct List *)page));
+    page->refc = 0;
+
+    return page;
 }
 
+/*
+ * Fills caches of pre-zeroed pages.
+ * This is called from the idle loop, so amount of work
+ * done by a single call is limited to ZERO_CACHE_REFILL bytes
+ */
 void
-unmap_region(struct AddressSpace *dspace, uintptr_t dst, uintptr_t size) {
-    int class = 0;
+zero_cache_refill(void) {
+    /* At least one page is zeroed if budget is not exhausted yet */
+    int64_t budget = ZERO_CACHE_REFILL;
+
+    /* Page tables are needed on every new mapping, so they go first */
+    while (pt_cache.count < PT_CACHE_TARGET && budget > 0) {
+        struct Page *page = alloc_page(0, PT_ALLOC_FLAGS);
+        if (!page) return;
+        page_ref(page);
 
-    uintptr_t start = ROUNDDOWN(dst, 1ULL << CLASS_BASE);
-    uintptr_t end = ROUNDUP(dst + size, 1ULL << CLASS_BASE);
+        nosan_memset(KADDR(page2pa(page)), 0, CLASS_SIZE(0));
+        pt_cache.pages[pt_cache.count++] = page;
+        budget -= CLASS_SIZE(0);
+    }
 
-    for (; class < MAX_CLASS && start + CLASS_SIZE(class) <= end; class ++) {
-        if (start & CLASS_SIZE(class)) {
-            unmap_page(dspace, start, class);
-            start += CLASS_SIZE(class);
+    for (int class = 0; class <= MAX_ALLOCATION_CLASS; class++) {
+        struct ZeroCache *cache = &zero_caches[class];
+        while (cache->count < zero_cache_target[class] && budget > 0) {
+            struct Page *page = alloc_page(class, 0);
+            if (!page) return;
+            page_ref(page);
+
+            nosan_memset(KADDR(page2pa(page)), 0, CLASS_SIZE(class));
+            cache->pages[cache->count++] = page;
+            budget -= CLASS_SIZE(class);
         }
     }
+}
 
-    for (; class >= 0 && start < end; class --) {
-        if (start + CLASS_SIZE(class) <= end) {
-            unmap_page(dspace, start, class);
-            start += CLASS_SIZE(class);
+/*
+ * Returns all pre-zeroed pages to the buddy tree.
+ * Returns number of released pages
+ */
+static size_t
+zero_cache_drain(void) {
+    size_t n = 0;
+    for (int class = 0; class <= MAX_ALLOCATION_CLASS; class++) {
+        struct ZeroCache *cache = &zero_caches[class];
+        while (cache->count) {
+            buddy_unref(cache->pages[--cache->count]);
+            n++;
         }
     }
+    return n;
+}
+
+/*
+ * Just allocate page, without mapping it.
+ * Page is filled with zeroes if ALLOC_ZERO is set.
+ * Memory of the given NUMA node is preferred
+ */
+static struct Page *
+alloc_page_node(int class, int flags, int node) {
+    struct Page *page = NULL;
+
+    if (flags & ALLOC_POOL) flags |= ALLOC_BOOTMEM;
+#ifndef SANITIZE_SHADOW_BASE
+    /* Descriptor pools should always be within
+     * PAGE_LINK_LIMIT to be addressable by compact links */
+    if (current_space && !(flags & ALLOC_POOL)) flags &= ~ALLOC_BOOTMEM;
+#endif
+    /* Caches only contain pages of the local node */
+    bool any_zone = !(flags & (ALLOC_BOOTMEM | ALLOC_DMA)) && node == numa_local_node;
+
+    /* Zeroed pages are taken from zero cache if possible */
+    if (flags & ALLOC_ZERO && any_zone &&
+        class <= MAX_ALLOCATION_CLASS && zero_caches[class].count) {
+        page = zero_caches[class].pages[--zero_caches[class].count];
+        assert(page->refc == 1 && !page->left && !page->right);
+        page->refc = 0;
+        zero_cache_hits++;
+        return page;
+    }
+
+    /* Zone-unconstrained 4K pages are taken from magazine */
+    if (!class && any_zone) page = magazine_alloc();
+
+    if (!page) page = buddy_alloc_page(class, flags, node);
+
+    /* Cached pages might be preventing merges */
+    if (!page && magazine_drain(this_magazine(), MAGAZINE_SIZE) + zero_cache_drain() + pt_cache_drain())
+        page = buddy_alloc_page(class, flags, node);
+
+    if (page && flags & ALLOC_ZERO) {
+        zero_cache_misses++;
+        nosan_memset(KADDR(page2pa(page)), 0, CLASS_SIZE(class));
+    }
+
+    return page;
 }
 
-/* Just allocate page, without mapping it */
+/* Allocate page from the local NUMA node */
 static struct Page *
 alloc_page(int class, int flags) {
-    struct List *li = NULL;
-    struct Page *peer = NULL;
+    return alloc_page_node(class, flags, numa_local_node);
+}
+
+/* Returns NUMA node user memory of address space should be allocated from */
+static int
+space_alloc_node(struct AddressSpace *spc) {
+    if (spc->numa_policy != NUMA_INTERLEAVE) return numa_local_node;
+
+    int node = spc->numa_next % numa_node_count;
+    spc->numa_next = (node + 1) % numa_node_count;
+    return node;
+}
+
+/*
+ * Releases empty descriptor pools back to the buddy allocator
+ * when there are more than DESC_HIGH_WATERMARK free descriptors.
+ * NOTE: This should only be called when no descriptors are
+ *       being manipulated, since it updates physical memory tree
+ */
+static void
+reclaim_pools(void) {
+    if (free_desc_count <= DESC_HIGH_WATERMARK) return;
+
+    struct PagePool **ppool = &first_pool;
+    while (*ppool && free_desc_count >= DESC_LOW_WATERMARK + POOL_DESCR) {
+        struct PagePool *pool = *ppool;
+        if (pool->used) {
+            ppool = &pool->next;
+            continue;
+        }
+
+        /* Empty pool always has free descriptors */
+        list_del(&pool->partial);
+        free_desc_count -= POOL_DESCR;
+        total_desc_count -= POOL_DESCR;
+        pool_count--;
+        reclaimed_pool_count++;
+
+        *ppool = pool->next;
+        if (trace_memory_more) cprintf("Releasing pool at %p\n", pool);
+        page_unref(pool->peer);
+    }
+}
+
+/*
+ * Finds address space and virtual address of the mapping
+ * using the path from the root of the virtual tree.
+ * Only user address spaces are looked up
+ */
+static struct AddressSpace *
+mapping_space(struct Page *mapping, uintptr_t *va) {
+    assert_virtual(mapping);
+
+    int class = pgptr(mapping->phy)->class;
+    uintptr_t addr = 0;
+    struct Page *node = mapping;
+    while (node->parent) {
+        struct Page *parent = pgptr(node->parent);
+        if (pgptr(parent->right) == node) addr |= CLASS_SIZE(class);
+        node = parent;
+        class ++;
+    }
+    assert(class == MAX_CLASS);
+
+    *va = addr;
+    return space_index_find(node);
+}
+
+/*
+ * Page can be migrated if all of its references come
+ * from user mappings (that form reverse map of the page)
+ * and it is referenced as a whole
+ */
+static bool
+page_movable(struct Page *page) {
+    if (page->state != ALLOCATABLE_NODE || page->left || page->right) return 0;
+
+    size_t nmap = 0;
+    for (struct List *li = listptr(page->head.next); li != &page->head; li = listptr(li->next)) {
+        uintptr_t va;
+        if (!mapping_space((struct Page *)li, &va)) return 0;
+        nmap++;
+    }
+
+    return nmap == page->refc;
+}
+
+/*
+ * Returns number of bytes used by physical subtree
+ * or -1 if it contains pages that cannot be migrated
+ */
+static int64_t
+compact_used(struct Page *node) {
+    if (!node) return 0;
+    if (node->state != ALLOCATABLE_NODE) return -1;
+    if (node->refc) return page_movable(node) ? (int64_t)CLASS_SIZE(node->class) : -1;
+
+    int64_t left = compact_used(pgptr(node->left));
+    int64_t right = compact_used(pgptr(node->right));
+    return left < 0 || right < 0 ? -1 : left + right;
+}
+
+/* Finds least used block of given class that can be evacuated */
+static void
+compact_find(struct Page *node, int class, struct Page **best, int64_t *best_used) {
+    /* Skip referenced and free subtrees */
+    if (!node || node->refc || (!node->left && !node->right)) return;
+    if (node->state != ALLOCATABLE_NODE && node->state != PARTIAL_NODE) return;
+
+    if (node->class == class) {
+        int64_t used = compact_used(node);
+        if (used >= 0 && used <= (int64_t)COMPACT_MAX_USED(class) && (!*best || used < *best_used)) {
+            *best = node;
+            *best_used = used;
+        }
+        return;
+    }
+
+    compact_find(pgptr(node->left), class, best, best_used);
+    compact_find(pgptr(node->right), class, best, best_used);
+}
+
+/*
+ * Moves contents of the page to the newly allocated one
+ * and remaps every mapping from the reverse map of the page.
+ * If some mapping cannot be moved the migration is aborted,
+ * mappings are returned to the old page and 0 is returned
+ */
+/* Maps old page back during aborted migration. Old page tables
+ * might have been reclaimed, and if they cannot be allocated again
+ * the mapping is left without page table entry, so access to it faults */
+static void
+migrate_restore(struct AddressSpace *spc, uintptr_t va, struct Page *old, int prot) {
+    ensure_free_desc(2 * (MAX_CLASS + 1));
+    if (map_page(spc, va, old, prot) < 0)
+        cprintf("<%p> Lost mapping at %08lX during aborted migration\n", spc, va);
+}
+
+static bool
+migrate_page(struct Page *old) {
+    /* Page stays on its NUMA node */
+    struct Page *new = buddy_alloc_page(old->class, 0, pa_node(page2pa(old)));
+    if (!new) return 0;
+
+    /* Keep new page referenced while mappings are moved */
+    page_ref(new);
+    nosan_memcpy(KADDR(page2pa(new)), KADDR(page2pa(old)), CLASS_SIZE(old->class));
+
+    /* map_page() replaces old mapping node, dropping its reference */
+    while (!list_empty(&old->head)) {
+        struct Page *mapping = (struct Page *)listptr(old->head.next);
+        uintptr_t va;
+        struct AddressSpace *spc = mapping_space(mapping, &va);
+        assert(spc);
+
+        int prot = PAGE_PROT(mapping->state);
+        ensure_free_desc(2 * (MAX_CLASS + 1));
+        if (map_page(spc, va, new, prot) < 0) {
+            /* Failed mapping is either removed or left
+             * on the new page without page table entry */
+            migrate_restore(spc, va, old, prot);
+            while (!list_empty(&new->head)) {
+                mapping = (struct Page *)listptr(new->head.next);
+                spc = mapping_space(mapping, &va);
+                assert(spc);
+                migrate_restore(spc, va, old, PAGE_PROT(mapping->state));
+            }
+            buddy_unref(new);
+            return 0;
+        }
+    }
+
+    buddy_unref(new);
+    migrated_count++;
+    return 1;
+}
+
+/* Migrates all referenced pages out of physical subtree */
+static bool
+evacuate_block(struct Page *node) {
+    if (!node) return 1;
+    if (node->refc > 1) return migrate_page(node);
+
+    page_push(node);
+    return evacuate_block(pgptr(node->left)) &&
+           evacuate_block(pgptr(node->right));
+}
+
+/*
+ * Tries to form free page of given class by migrating
+ * movable pages out of the least used block of that class.
+ * Returns true if the block was freed
+ */
+static bool
+compact_class(int class) {
+    if (compact_deferred) {
+        compact_deferred--;
+        return 0;
+    }
+
+    /* Pages cached in magazine pin their blocks */
+    magazine_drain(this_magazine(), MAGAZINE_SIZE);
+
+    struct Page *block = NULL;
+    int64_t used = 0;
+    compact_find(&root, class, &block, &used);
+    if (!block) {
+        compact_deferred = COMPACT_DEFER;
+        return 0;
+    }
+
+    if (trace_memory) cprintf("Compacting [%08lX, %08lX] (%zu bytes used)\n",
+                              page2pa(block), page2pa(block) + (long)CLASS_MASK(class), (size_t)used);
+
+    /* Referencing the whole block takes its free parts out of
+     * free lists so that pages are not migrated within the block.
+     * Migrated pages are left referenced only by the block itself */
+    page_ref(block);
+    bool res = evacuate_block(block);
+    /* NOTE Block descriptor might be freed by merging here */
+    buddy_unref(block);
+
+    if (res)
+        compacted_count++;
+    else
+        compact_deferred = COMPACT_DEFER;
+    return res;
+}
+
+/*
+ * Re-forms free 2MB page if there are none left.
+ * This is called from the idle loop
+ */
+void
+compact_memory(void) {
+    for (int node = 0; node < numa_node_count; node++)
+        for (int z = 0; z < ZONE_COUNT; z++)
+            for (int class = MAX_ALLOCATION_CLASS; class < MAX_CLASS; class ++)
+                if (!list_empty(&free_classes[node][z][class])) return;
+
+    /* Descriptors of migrated mappings are released here,
+     * since compaction can run within allocations */
+    compact_class(MAX_ALLOCATION_CLASS);
+    reclaim_pools();
+}
+
+/* Physical addresses of these pages are not used by anyone,
+ * so they can be moved to form huge page */
+static bool
+promote_allowed(struct AddressSpace *spc, uintptr_t va) {
+    /* Light spaces have no mapping nodes to merge */
+    if (spc != &kspace) return va < MAX_USER_ADDRESS && !spc->light;
+#ifdef SANITIZE_SHADOW_BASE
+    return SANITIZE_SHADOW_BASE <= va && va < SANITIZE_SHADOW_BASE + SANITIZE_SHADOW_SIZE;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Replaces mappings of fully populated 2MB block with single huge page.
+ * Every page of the block should be private to the mapping, not lazy
+ * and mapped with the same protection. Pages are copied to the newly
+ * allocated huge page unless they already form one.
+ * Returns 1 if block was promoted, 0 if it cannot be and
+ * -E_NO_MEM if there is no free huge page
+ */
+static int
+promote_block(struct AddressSpace *spc, uintptr_t va) {
+    const int class = MAX_ALLOCATION_CLASS;
+    assert(!(va & CLASS_MASK(class)));
+
+    struct PageCursor cur;
+    cursor_init(&cur, spc);
+    struct Page *node = page_lookup_cursor(&cur, va, class, LOOKUP_PRESERVE);
+    if (!node || node->phy || cur.class != class) return 0;
+
+    int prot = -1;
+    physaddr_t base = 0;
+    bool contiguous = 1;
+    for (uintptr_t addr = va; addr < va + CLASS_SIZE(class);) {
+        struct Page *mapping = page_lookup_cursor(&cur, addr, 0, LOOKUP_PRESERVE);
+        struct Page *phy = mapping ? pgptr(mapping->phy) : NULL;
+        if (!phy) return 0;
+
+        page_push_path(phy);
+        if (phy->state != ALLOCATABLE_NODE || !PAGE_IS_UNIQ(phy) ||
+            mapping->state & PROT_LAZY) return 0;
+
+        if (prot < 0) {
+            prot = PAGE_PROT(mapping->state);
+            base = page2pa(phy);
+            contiguous = !(base & CLASS_MASK(class));
+        }
+        if (PAGE_PROT(mapping->state) != prot) return 0;
+
+        contiguous &= page2pa(phy) == base + (addr - va);
+        addr += CLASS_SIZE(phy->class);
+    }
+
+    struct Page *page = NULL;
+    if (contiguous) {
+        /* Pages are buddies already, so just map them as a whole */
+        page = page_lookup(NULL, base, class, PARTIAL_NODE, 0);
+        assert(page && page->class == class);
+        if (page->state != ALLOCATABLE_NODE) page = NULL;
+    }
+
+    if (!page) {
+        if (!(page = alloc_page_node(class, 0, space_alloc_node(spc)))) return -E_NO_MEM;
+
+        /* Old pages are freed by map_page() */
+        for (uintptr_t addr = va; addr < va + CLASS_SIZE(class);) {
+            struct Page *phy = pgptr(page_lookup_cursor(&cur, addr, 0, LOOKUP_PRESERVE)->phy);
+            nosan_memcpy(KADDR(page2pa(page) + (addr - va)), KADDR(page2pa(phy)), CLASS_SIZE(phy->class));
+            addr += CLASS_SIZE(phy->class);
+        }
+        promoted_copy_count++;
+    }
+
+    /* Page table of the block and tables above it that become empty
+     * are cached on unmapping and reused for the huge page, so map_page()
+     * does not allocate memory after small pages are unmapped */
+    pt_cache_reserve(3);
+    ensure_free_desc(2 * (MAX_CLASS + 1));
+
+    /* Invalidate TLB of the space */
+    struct AddressSpace *old = switch_address_space(spc);
+    int res = map_page(spc, va, page, prot);
+    switch_address_space(old);
+    if (res < 0) return res;
 
-    if (flags & ALLOC_POOL) flags |= ALLOC_BOOTMEM;
-#ifndef SANITIZE_SHADOW_BASE
-    if (current_space) flags &= ~ALLOC_BOOTMEM;
-#endif
+    promoted_count++;
+    return 1;
+}
 
-    /* Find page that is not smaller than requested
-     * (Pool memory should also be within BOOT_MEM_SIZE) */
-    for (int pclass = class; pclass < MAX_CLASS; pclass++, li = NULL) {
-        for (li = free_classes[pclass].next; li != &free_classes[pclass]; li = li->next) {
-            peer = (struct Page *)li;
-            assert(peer->state == ALLOCATABLE_NODE);
-            assert_physical(peer);
-            if (!(flags & ALLOC_BOOTMEM) || page2pa(peer) + CLASS_SIZE(class) < BOOT_MEM_SIZE) goto found;
-        }
+/* Returns -E_NO_MEM if there is no free huge pages to promote blocks */
+static int
+promote_subtree(struct AddressSpace *spc, struct Page *node, int class, uintptr_t va, size_t *budget) {
+    if (!node || node->phy || !*budget) return 0;
+
+    if (class == MAX_ALLOCATION_CLASS) {
+        if (!promote_allowed(spc, va)) return 0;
+        int res = promote_block(spc, va);
+        if (res > 0) (*budget)--;
+        return MIN(res, 0);
     }
-    return NULL;
 
-found:
-    list_del(li);
+    int res = promote_subtree(spc, pgptr(node->left), class - 1, va, budget);
+    if (res < 0) return res;
+    return promote_subtree(spc, pgptr(node->right), class - 1, va + CLASS_SIZE(class - 1), budget);
+}
 
-    size_t ndesc = 0;
-    static bool allocating_pool;
-    if (flags & ALLOC_POOL) {
-        assert(!allocating_pool);
-        allocating_pool = 1;
+/*
+ * Promotes 2MB block containing va after the page fault.
+ * Page table is checked first to quickly skip
+ * partially populated blocks.
+ * NOTE This should not be called from kernel mode page faults
+ *      since they can interrupt modification of the virtual tree
+ */
+void
+promote_huge_page(struct AddressSpace *spc, uintptr_t va) {
+    va = ROUNDDOWN(va, CLASS_SIZE(MAX_ALLOCATION_CLASS));
+    if (!promote_allowed(spc, va)) return;
+
+    pml4e_t pml4e = spc->pml4[PML4_INDEX(va)];
+    if (!(pml4e & PTE_P)) return;
+    pdpe_t pdpe = ((pdpe_t *)KADDR(PTE_ADDR(pml4e)))[PDP_INDEX(va)];
+    if (!(pdpe & PTE_P) || pdpe & PTE_PS) return;
+    pde_t pde = ((pde_t *)KADDR(PTE_ADDR(pdpe)))[PD_INDEX(va)];
+    if (!(pde & PTE_P) || pde & PTE_PS) return;
+
+    pte_t *pt = KADDR(PTE_ADDR(pde));
+    for (size_t i = 0; i < PT_ENTRY_COUNT; i++)
+        if (!(pt[i] & PTE_P) || (pt[i] ^ pt[0]) & PROMOTE_PTE_MASK) return;
+
+    promote_block(spc, va);
+}
 
-        struct PagePool *newpool = KADDR(page2pa(peer));
-#ifdef SANITIZE_SHADOW_BASE
-        /* Need to unpoison early to initiallize lists inplace */
-        if (current_space) platform_asan_unpoison(newpool, CLASS_SIZE(class));
-#endif
-        ndesc = POOL_ENTRIES_FOR_SIZE(CLASS_SIZE(class));
-        for (size_t i = 0; i < ndesc; i++)
-            list_append(&free_descriptors, (struct List *)&newpool->data[i]);
-        newpool->next = first_pool;
-        first_pool = newpool;
-        free_desc_count += ndesc;
-        if (trace_memory_more) cprintf("Allocated pool of size %zu at [%08lX, %08lX]\n",
-                                       ndesc, page2pa(peer), page2pa(peer) + (long)CLASS_MASK(class));
+/*
+ * Forms huge pages in address spaces populated
+ * with small pages since the last pass.
+ * This is called from the idle loop
+ */
+void
+promote_memory(void) {
+    size_t budget = PROMOTE_BATCH;
+    for (size_t i = 0; i <= NENV && budget; i++) {
+        if (i < NENV && envs[i].env_status == ENV_FREE) continue;
+        struct AddressSpace *spc = i < NENV ? &envs[i].address_space : &kspace;
+        if (!spc->promote_pending) continue;
+
+        int res = promote_subtree(spc, spc->root, MAX_CLASS, 0, &budget);
+        /* Rescan space later if it was not scanned completely */
+        if (!res && budget) spc->promote_pending = 0;
     }
+}
 
-    struct Page *new = page_lookup(peer, page2pa(peer), class, PARTIAL_NODE, 1);
-    assert(!new->refc);
+/* Returns maximal reference count of the pages within mapped page */
+static uint32_t
+page_maxref(struct Page *phy) {
+    /* Filler pages are never shared since writes copy them */
+    if (page_is_filler(phy)) return 1;
 
-    if (flags & ALLOC_POOL) {
-        assert(KADDR(page2pa(new)) == first_pool);
-#ifdef SANITIZE_SHADOW_BASE
-        assert(page2pa(new) + CLASS_SIZE(new->class) <= BOOT_MEM_SIZE);
-#endif
-        page_ref(new);
-        first_pool->peer = new;
-        allocating_pool = 0;
-    } else {
-        if (trace_memory_more) cprintf("Allocated page at [%08lX, %08lX] class=%d\n",
-                                       page2pa(new), page2pa(new) + (long)CLASS_MASK(new->class), new->class);
+    page_push_path(phy);
+    return phy->refc + (phy->left || phy->right);
+}
+
+/* Returns maximal reference count of the pages mapped
+ * within the virtual subtree, caching it in subtree nodes */
+static uint32_t
+subtree_maxref(struct Page *node) {
+    if (!node) return 0;
+
+    if (maxref_valid(node)) return node->maxref;
+
+    uint32_t res = node->phy ? page_maxref(pgptr(node->phy)) :
+                               MAX(subtree_maxref(pgptr(node->left)),
+                                   subtree_maxref(pgptr(node->right)));
+    /* Counts not fitting the cache are recomputed every time
+     * (counts of ancestors are not smaller, so they are not cached too) */
+    if (res <= MAXREF_MAX) {
+        node->maxref = res;
+        node->maxref_gen = maxref_generation;
     }
+    return res;
+}
 
-    assert(page2pa(new) >= PADDR(end) || page2pa(new) + CLASS_MASK(new->class) < IOPHYSMEM);
+/*
+ * Returns maximal reference count of the pages mapped within [start, end)
+ * by the subtree of node of given class at addr. Only nodes on the paths
+ * to region boundaries are visited, others are covered by their caches
+ */
+static uint32_t
+range_maxref(struct Page *node, int class, uintptr_t addr, uintptr_t start, uintptr_t end) {
+    if (!node || addr >= end || addr + CLASS_SIZE(class) <= start) return 0;
 
-    return new;
+    if (node->phy || (start <= addr && addr + CLASS_SIZE(class) <= end))
+        return subtree_maxref(node);
+
+    return MAX(range_maxref(pgptr(node->left), class - 1, addr, start, end),
+               range_maxref(pgptr(node->right), class - 1, addr + CLASS_SIZE(class - 1), start, end));
 }
 
 int
 region_maxref(struct AddressSpace *spc, uintptr_t addr, size_t size) {
     uintptr_t start = ROUNDDOWN(addr, PAGE_SIZE);
     uintptr_t end = ROUNDUP(addr + size, PAGE_SIZE);
-    int res = 0;
-    while (start < end) {
-        struct Page *page = page_lookup_virtual(spc->root, start, 0, LOOKUP_PRESERVE);
-        if (page && page->phy) {
-            res = MAX(res, page->phy->refc + (page->phy->left || page->phy->right));
-            start += CLASS_SIZE(page->phy->class);
-        } else
-            start += CLASS_SIZE(0);
+    if (start >= end) return 0;
+
+    if (!spc->light) return range_maxref(spc->root, MAX_CLASS, 0, start, end);
+
+    /* Light spaces have no caches, so every mapping is visited.
+     * Pages of shared tables are referenced once by every sharer */
+    uint32_t res = 0;
+    for (uintptr_t next; start < MIN(end, MAX_USER_ADDRESS); start = next) {
+        struct LightMapping map;
+        if (!light_lookup(spc, start, &map, &next)) continue;
+        struct Page *phy = light_phy(&map);
+        res = MAX(res, page_maxref(phy) + (page_is_filler(phy) ? 0 : map.shares));
     }
     return res;
 }
@@ -1153,26 +3137,12 @@ addr_common_class(uintptr_t addr1, uintptr_t addr2) {
 }
 
 
+/* Maps physical memory at pstart to [start, end) with
+ * the largest pages allowed by alignment */
 static int
-map_physical_region(struct AddressSpace *dst, uintptr_t dstart, uintptr_t pstart, size_t size, int flags) {
-    if (trace_memory) cprintf("Mapping physical region [%08lX, %08lX] to [%08lX, %08lX] (flags=%x)\n",
-                              pstart, pstart + (long)size - 1, dstart, dstart + (long)size - 1, flags);
-    assert(dstart > MAX_USER_ADDRESS || dst == &kspace);
-
+map_physical_pages(struct AddressSpace *dst, uintptr_t start, uintptr_t end, uintptr_t pstart, int flags) {
     int class = 0, res;
-
-    uintptr_t start = ROUNDDOWN(dstart, CLASS_SIZE(0));
-    uintptr_t end = ROUNDUP(dstart + size, CLASS_SIZE(0));
-    pstart = ROUNDDOWN(pstart, CLASS_SIZE(0));
-
-#if SANITIZE_SHADOW_BASE
-    if (!(flags & ALLOC_WEAK) && dst == &kspace &&
-        current_space && dstart >= 512 * GB) {
-        platform_asan_unpoison((void *)start, size);
-    }
-#endif
-
-    int max_class = addr_common_class(dstart, pstart);
+    int max_class = addr_common_class(start, pstart);
     for (; class < max_class && start + CLASS_SIZE(class) <= end; class ++) {
         if (start & CLASS_SIZE(class)) {
             struct Page *page = page_lookup(NULL, pstart, class, PARTIAL_NODE, 1);
@@ -1194,38 +3164,162 @@ map_physical_region(struct AddressSpace *dst, uintptr_t dstart, uintptr_t pstart
         }
     }
 
-
     return 0;
 }
 
+static int
+map_physical_region(struct AddressSpace *dst, uintptr_t dstart, uintptr_t pstart, size_t size, int flags) {
+    if (trace_memory) cprintf("Mapping physical region [%08lX, %08lX] to [%08lX, %08lX] (flags=%x)\n",
+                              pstart, pstart + (long)size - 1, dstart, dstart + (long)size - 1, flags);
+    assert(dstart > MAX_USER_ADDRESS || dst == &kspace);
+
+    uintptr_t start = ROUNDDOWN(dstart, CLASS_SIZE(0));
+    uintptr_t end = ROUNDUP(dstart + size, CLASS_SIZE(0));
+    pstart = ROUNDDOWN(pstart, CLASS_SIZE(0));
+
+#if SANITIZE_SHADOW_BASE
+    if (!(flags & ALLOC_WEAK) && dst == &kspace &&
+        current_space && dstart >= 512 * GB) {
+        platform_asan_unpoison((void *)start, size);
+    }
+#endif
+
+    return map_physical_pages(dst, start, end, pstart, flags);
+}
+
+/* Maps kernel memory at [src, src + size) to user address space lazily,
+ * so pages are copied on the first write. Source should stay mapped to
+ * kspace (like program images, see init_memory()), so user mappings
+ * never own its pages exclusively */
+int
+map_kernel_lazy(struct AddressSpace *spc, uintptr_t dst, const void *src, size_t size, int flags) {
+    if (dst & CLASS_MASK(0) || (uintptr_t)src & CLASS_MASK(0) || size & CLASS_MASK(0)) return -E_INVAL;
+    if (dst >= MAX_USER_ADDRESS || size > MAX_USER_ADDRESS - dst) return -E_INVAL;
+
+    tlb_gather_begin();
+    int res = map_physical_pages(spc, dst, dst + size, PADDR((void *)src), (flags & ~PROT_SHARE) | PROT_LAZY);
+    tlb_gather_end();
+    return res;
+}
+
+/* Maps private copy of kernel memory at [src, src + size) to dst of user
+ * address space. Covered pages are allocated right away with the rest of
+ * them zeroed and are filled through kernel direct map, so neither
+ * dst nor src needs to be aligned and mapping can be read-only */
+int
+map_kernel_copy(struct AddressSpace *spc, uintptr_t dst, const void *src, size_t size, int flags) {
+    uintptr_t start = ROUNDDOWN(dst, PAGE_SIZE), end = ROUNDUP(dst + size, PAGE_SIZE);
+    if (dst >= MAX_USER_ADDRESS || end > MAX_USER_ADDRESS || end < start) return -E_INVAL;
+    if (!size) return 0;
+
+    int res = 0;
+    tlb_gather_begin();
+    for (uintptr_t va = start; !res && va < end; va += PAGE_SIZE) {
+        struct Page *page = alloc_page_node(0, ALLOC_ZERO, space_alloc_node(spc));
+        if (!page) {
+            res = -E_NO_MEM;
+            break;
+        }
+
+        uintptr_t from = MAX(va, dst), to = MIN(va + PAGE_SIZE, dst + size);
+        nosan_memcpy((uint8_t *)KADDR(page2pa(page)) + (from - va), (uint8_t *)src + (from - dst), to - from);
+        res = map_page(spc, va, page, flags & ~(PROT_LAZY | PROT_SHARE));
+    }
+    tlb_gather_end();
+    return res;
+}
+
+
 /* Allocate page (possibly physically discontiguous) and map it to address space */
+static int compose_page(struct AddressSpace *spc, uintptr_t addr, int class, int flags);
+
+/* Allocates part of composite page without compaction */
+static int
+alloc_page_part(struct AddressSpace *spc, uintptr_t addr, int class, int flags) {
+    struct Page *page = alloc_page_node(class, flags, space_alloc_node(spc));
+    return page ? map_page(spc, addr, page, flags) : compose_page(spc, addr, class, flags);
+}
+
+/* If bigger page is not found try
+ * to compose page from smaller pages recursively */
+static int
+compose_page(struct AddressSpace *spc, uintptr_t addr, int class, int flags) {
+    if (!class) return -E_NO_MEM;
+
+    int res = alloc_page_part(spc, addr, class - 1, flags);
+    if (res < 0) return res;
+    if ((res = alloc_page_part(spc, addr + CLASS_SIZE(class - 1), class - 1, flags)) < 0)
+        unmap_page(spc, addr, class - 1);
+    return res;
+}
+
 int
 alloc_composite_page(struct AddressSpace *spc, uintptr_t addr, int class, int flags) {
-    int res = -E_NO_MEM;
-
     assert(!(addr & CLASS_MASK(class)));
 
-    struct Page *page = alloc_page(class, flags);
-    if (page) {
-        res = map_page(spc, addr, page, flags);
-    } else if (class) {
-        /* If bigger page is not found try
-         * to compose page from smaller pages recursively */
-        if ((res = alloc_composite_page(spc, addr, class - 1, flags)) < 0) return res;
-        if ((res = alloc_composite_page(spc, addr + CLASS_SIZE(class - 1), class - 1, flags)) < 0)
-            unmap_page(spc, addr, class - 1);
+    int node = space_alloc_node(spc);
+    struct Page *page = alloc_page_node(class, flags, node);
+    /* Try to form huge page before splitting it into smaller ones.
+     * Compaction migrates mapped pages, so it is only done before
+     * any part of the composite page is allocated */
+    if (!page && class >= MAX_ALLOCATION_CLASS && compact_class(class))
+        page = alloc_page_node(class, flags, node);
+    return page ? map_page(spc, addr, page, flags) : compose_page(spc, addr, class, flags);
+}
+
+/* Replaces lazy mapping of phy at va with private copy of it */
+static int
+copy_lazy_page(struct AddressSpace *spc, uintptr_t va, struct Page *phy, int flags) {
+    if (trace_memory) {
+        cprintf("<%p> Allocating new page [%08lX, %08lX] flags=%x\n", spc,
+                va, va + (long)CLASS_MASK(phy->class), flags & PROT_ALL & ~PROT_LAZY);
     }
 
+    /* Copies of zero page are taken already zeroed */
+    bool zero = page_is_zero(phy);
+    page_ref(phy);
+    int res = alloc_composite_page(spc, va, phy->class, (flags & PROT_ALL & ~PROT_LAZY) | (zero ? ALLOC_ZERO : 0));
+    if (!res && !zero) memcpy_page(spc, va, phy);
+    page_unref(phy);
     return res;
 }
 
+/*
+ * Allocates lazy zero- and one-filled pages mapped with given protection
+ * within aligned window of 2^spc->fault_around pages around va,
+ * so that first touches of the region do not fault on every page.
+ * Allocation failures are ignored since these pages are not needed yet
+ */
+static void
+fault_around(struct AddressSpace *spc, uintptr_t va, int prot) {
+    int wclass = spc->fault_around;
+    uintptr_t start = ROUNDDOWN(va, CLASS_SIZE(wclass));
+    uintptr_t end = start + CLASS_SIZE(wclass);
+
+    struct PageCursor cur;
+    cursor_init(&cur, spc);
+    for (uintptr_t addr = start, next; addr < end; addr = next) {
+        int mprot;
+        struct Page *phy = mapping_walk(&cur, addr, &mprot, &next);
+        if (!phy) continue;
+
+        addr = ROUNDDOWN(addr, CLASS_SIZE(phy->class));
+        if (phy->class <= wclass && mprot == prot &&
+            (page_is_zero(phy) || page_is_one(phy))) {
+            if (copy_lazy_page(spc, addr, phy, prot) < 0) break;
+            fault_around_count++;
+            /* Mapping node under the cursor is replaced */
+            cursor_init(&cur, spc);
+        }
+    }
+}
+
+/* Resolves lazy mapping at va, user is set for faults of user mode code */
 int
-force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass) {
+force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass, bool user) {
     int res = -E_FAULT;
-    /* FIXME We need to propagate kernel PML4E
-     * changes to every AddressSpace or just use KPTI
-     * (now it's ok since kernel does not map huge chunks of memory (>= 512GB)
-     * to higher part of address space after initiallization) */
+    /* Kernel PML4 entries are allocated once by init_kspace(),
+     * so kernel mappings made here are visible in every address space */
 
     static_assert(!(MAX_USER_ADDRESS & (HUGE_PAGE_SIZE * 512 * 512 - 1)), "MAX_USER_ADDRESS should be alligned on 512GiB");
 
@@ -1237,29 +3331,61 @@ force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass) {
 
 
     /* Lookup page mapping such that it's class it not larger than MAX_ALLOCATION_CLASS */
-    struct Page *page;
-    if (!(page = page_lookup_virtual(spc->root, va, maxclass, LOOKUP_SPLIT))) goto fault;
-    if (!(page = page_lookup_virtual(spc->root, va, 0, LOOKUP_PRESERVE))) goto fault;
-    if (!(page->state & PROT_LAZY)) goto fault;
+    struct Page *phy;
+    int prot;
+    if (spc->light) {
+        struct LightMapping map;
+        uintptr_t next;
+        if (va >= MAX_USER_ADDRESS) goto fault;
+        /* Writes through shared tables fault even for writable pages */
+        int resolved = light_unshare(spc, ROUNDDOWN(va, PAGE_SIZE), ROUNDDOWN(va, PAGE_SIZE) + PAGE_SIZE);
+        if (resolved < 0) {
+            res = resolved;
+            goto fault;
+        }
+        int split = light_split(spc, va, maxclass);
+        if (split < 0) {
+            res = split;
+            goto fault;
+        }
+        if (!light_lookup(spc, va, &map, &next)) goto fault;
+        if (resolved && !(map.prot & PROT_LAZY)) {
+            res = 0;
+            goto fault;
+        }
+        phy = light_phy(&map);
+        prot = map.prot;
+    } else {
+        struct Page *page;
+        if (!(page = page_lookup_virtual(spc, va, maxclass, LOOKUP_SPLIT))) goto fault;
+        if (!(page = page_lookup_virtual(spc, va, 0, LOOKUP_PRESERVE))) goto fault;
+        phy = pgptr(page->phy);
+        prot = PAGE_PROT(page->state);
+    }
+    if (!(prot & PROT_LAZY)) goto fault;
+
+    va &= ~CLASS_MASK(phy->class);
 
-    va &= ~CLASS_MASK(page->phy->class);
+    page_push_path(phy);
+    /* Block with small pages can be promoted later */
+    if (phy->class < MAX_ALLOCATION_CLASS && promote_allowed(spc, va))
+        spc->promote_pending = 1;
 
-    if (PAGE_IS_UNIQ(page->phy)) {
+    if (PAGE_IS_UNIQ(phy)) {
         /* If we have the only reference to the page and
          * and its mapping to itself we can actually just
          * disable lazy flag and not bother copying */
-        res = map_page(spc, va, page->phy, page->state & ~PROT_LAZY);
+        res = map_page(spc, va, phy, prot & ~PROT_LAZY);
     } else {
-        if (trace_memory) {
-            cprintf("<%p> Allocating new page [%08lX, %08lX] flags=%x\n", spc,
-                    va, va + (long)CLASS_MASK(page->phy->class), page->state & PROT_ALL & ~PROT_LAZY);
-        }
-
-        struct Page *phy = page->phy;
-        page_ref(phy);
-        res = alloc_composite_page(spc, va, phy->class, page->state & PROT_ALL & ~PROT_LAZY);
-        if (!res) memcpy_page(spc, va, phy);
-        page_unref(phy);
+        bool filler = page_is_zero(phy) || page_is_one(phy);
+        res = copy_lazy_page(spc, va, phy, prot);
+        lazy_fault_count++;
+
+        /* Neighbouring pages of lazily allocated region are likely
+         * to be touched soon. Only user mode faults are handled since
+         * kernel ones can interrupt virtual tree modification */
+        if (!res && filler && user && spc != &kspace && phy->class < spc->fault_around)
+            fault_around(spc, va, prot);
     }
 
 fault:
@@ -1292,6 +3418,11 @@ do_map_page(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *ssp
     assert(!(oldflags & PROT_LAZY) | !(oldflags & PROT_SHARE));
     assert(!(flags & PROT_LAZY) | !(flags & PROT_SHARE));
 
+    /* Shared pages are never copied, so lazy copy of them
+     * is the same page and cannot enable RWX either */
+    if (oldflags & PROT_SHARE && flags & PROT_LAZY)
+        flags = (flags & ~PROT_LAZY) | PROT_SHARE;
+
     /* Cannot enable RWX if not copying and they were disabled */
     if (!(flags & PROT_LAZY) && ~oldflags &
                                         (PROT_R | PROT_W | PROT_X) & flags) return -E_INVAL;
@@ -1315,20 +3446,25 @@ do_map_page(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *ssp
     /* Lock page so it cannot be deallocated during copying/mapping */
     if (!(flags & PROT_LAZY) && (oldflags & PROT_LAZY)) {
         int class = phy->class;
-        res = force_alloc_page(sspace, src, MAX_CLASS);
+        res = force_alloc_page(sspace, src, MAX_CLASS, 0);
         if (res < 0 || (sspace == dspace && src == dst)) return res;
 
-        struct Page *newv = page_lookup_virtual(sspace->root, src, class, LOOKUP_PRESERVE);
-        check_virtual_class(newv, class);
-        assert(newv && newv->phy);
-        phy = newv->phy;
+        if (sspace->light) {
+            struct LightMapping map;
+            uintptr_t next;
+            bool mapped = light_lookup(sspace, src, &map, &next);
+            assert(mapped && map.class == class);
+            phy = light_phy(&map);
+        } else {
+            struct Page *newv = page_lookup_virtual(sspace, src, class, LOOKUP_PRESERVE);
+            check_virtual_class(newv, class);
+            assert(newv && newv->phy);
+            phy = pgptr(newv->phy);
+        }
     }
 
     page_ref(phy);
 
-    if (oldflags & PROT_SHARE && flags & PROT_LAZY)
-        flags = (flags & ~PROT_LAZY) | PROT_SHARE;
-
     bool need_remap = (flags & PROT_LAZY) && (sspace != dspace || src != dst);
 
     res = map_page(dspace, dst, phy, flags);
@@ -1352,22 +3488,78 @@ do_map_subtree(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *
         if (vpage->phy) {
             assert((vpage->state & NODE_TYPE_MASK) == MAPPING_NODE);
             return do_map_page(dspace, dst, sspace, src,
-                               vpage->phy, vpage->state & PROT_ALL, flags);
+                               pgptr(vpage->phy), vpage->state & PROT_ALL, flags);
         }
         assert(vpage->state == INTERMEDIATE_NODE);
 
         if (vpage->left && (res = do_map_subtree(dspace, dst,
-                                                 sspace, src, vpage->left, class - 1, flags)) < 0) break;
+                                                 sspace, src, pgptr(vpage->left), class - 1, flags)) < 0) break;
 
         dst += CLASS_SIZE(class - 1);
         src += CLASS_SIZE(class - 1);
-        vpage = vpage->right;
+        vpage = pgptr(vpage->right);
         class --;
     }
     return res;
 }
 
-static struct Page *zero_page, *one_page;
+/* Flags of copy that keeps protection of every page,
+ * only making private ones lazy (as fork() does) */
+#define LIGHT_SHARE_FLAGS (PROT_RWX | PROT_CD | PROT_USER_ | PROT_SHARE | PROT_LAZY | PROT_COMBINE)
+
+/*
+ * Makes dspace share page table covering aligned block of given class
+ * at addr with sspace, write-protecting the entries pointing to it.
+ * Returns 1 if the block is not covered by a whole table
+ */
+static int
+light_share(struct AddressSpace *dspace, struct AddressSpace *sspace, uintptr_t addr, int class) {
+    size_t size = CLASS_SIZE(class);
+    int res = light_split(sspace, addr, class);
+    if (res < 0) return res;
+
+    pte_t *sentry = light_walk(sspace, addr, size, LOOKUP_PRESERVE);
+    if (!sentry || !(*sentry & PTE_P) || *sentry & PTE_PS) return 1;
+
+    if ((res = unmap_page(dspace, addr, class)) < 0) return res;
+    pte_t *dentry = light_walk(dspace, addr, size, LOOKUP_ALLOC);
+    if (!dentry) return -E_NO_MEM;
+    assert(!*dentry);
+
+    page_ref(pt_page(KADDR(PTE_ADDR(*sentry))));
+    *sentry &= ~PTE_W;
+    *dentry = *sentry;
+
+    tlb_invalidate_range(sspace, addr, addr + size, PAGE_SIZE);
+    return 0;
+}
+
+/* Maps light mappings of aligned block of given class at src,
+ * splitting the one that covers the block */
+static int
+do_map_light(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspace, uintptr_t src, int class, int flags) {
+    if (src >= MAX_USER_ADDRESS) return 0;
+
+    /* Whole tables are shared between light spaces instead of being copied.
+     * Protection of shared pages is the same in both spaces, so application
+     * flags (PROT_AVAIL) are preserved too */
+    if (dspace != sspace && dspace->light && src == dst &&
+        (class == 9 || class == 18 || class == 27) &&
+        (flags & LIGHT_SHARE_FLAGS) == LIGHT_SHARE_FLAGS) {
+        int res = light_share(dspace, sspace, src, class);
+        if (res <= 0) return res;
+    }
+
+    int res = light_split(sspace, src, class);
+
+    uintptr_t end = MIN(src + CLASS_SIZE(class), MAX_USER_ADDRESS), next;
+    for (uintptr_t addr = src; !res && addr < end; addr = next) {
+        struct LightMapping map;
+        if (light_lookup(sspace, addr, &map, &next))
+            res = do_map_page(dspace, dst + (addr - src), sspace, addr, light_phy(&map), map.prot, flags);
+    }
+    return res;
+}
 
 static int
 do_map_region_one_page(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspace, uintptr_t src, int class, int flags) {
@@ -1377,14 +3569,16 @@ do_map_region_one_page(struct AddressSpace *dspace, uintptr_t dst, struct Addres
     if (flags & (ALLOC_ONE | ALLOC_ZERO)) {
         if (flags & PROT_SHARE) {
             /* Shared pages cannot be lazily allocated
-             * So just allocate them and filled with 0's/FF's */
-            res = alloc_composite_page(dspace, dst, class, flags & PROT_ALL & ~(PROT_LAZY | PROT_COMBINE));
-            if (!res) {
+             * So just allocate them and filled with 0's/FF's
+             * (zeroed pages are allocated already filled) */
+            res = alloc_composite_page(dspace, dst, class, (flags & PROT_ALL & ~(PROT_LAZY | PROT_COMBINE)) | (flags & ALLOC_ZERO));
+            if (!res && flags & ALLOC_ONE) {
                 assert(current_space);
                 assert(dspace);
                 struct AddressSpace *old = switch_address_space(dspace);
+                tlb_gather_flush();
                 set_wp(0);
-                nosan_memset((void *)dst, flags & ALLOC_ONE ? 0xFF : 0x00, CLASS_SIZE(class));
+                nosan_memset((void *)dst, 0xFF, CLASS_SIZE(class));
                 set_wp(1);
                 switch_address_space(old);
             }
@@ -1407,12 +3601,15 @@ do_map_region_one_page(struct AddressSpace *dspace, uintptr_t dst, struct Addres
                 dst += size_inc;
             }
         }
+    } else if (sspace->light) {
+        return do_map_light(dspace, dst, sspace, src, class, flags);
     } else {
-        struct Page *page1 = page_lookup_virtual(sspace->root, src, class, LOOKUP_ALLOC);
+        struct Page *page1 = page_lookup_virtual(sspace, src, class, LOOKUP_ALLOC);
         assert(page1);
-        if (page1->phy && page1->phy->class > class) {
+        struct Page *phy1 = pgptr(page1->phy);
+        if (phy1 && phy1->class > class) {
             /* We need to split physical page if part of it is remapped */
-            struct Page *page = page_lookup(page1->phy, src, class, PARTIAL_NODE, 1);
+            struct Page *page = page_lookup(phy1, src, class, PARTIAL_NODE, 1);
             return do_map_page(dspace, dst, sspace, src, page, page1->state & PROT_ALL, flags);
         } else {
             check_virtual_class(page1, class);
@@ -1425,16 +3622,8 @@ do_map_region_one_page(struct AddressSpace *dspace, uintptr_t dst, struct Addres
     return res;
 }
 
-int
-map_region(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspace, uintptr_t src, uintptr_t size, int flags) {
-    if (src & CLASS_MASK(0) || (!sspace && !(flags & (ALLOC_ZERO | ALLOC_ONE)))) return -E_INVAL;
-    if (dst & CLASS_MASK(0) || !dspace) return -E_INVAL;
-    if (size & CLASS_MASK(0) || !size) return -E_INVAL;
-
-    /* FIXME This thing does not properly handle
-     * remapping overlapping regions to higher addresses */
-    assert(sspace != dspace || dst <= src || ABSDIFF(src, dst) >= size);
-
+static int
+do_map_region(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspace, uintptr_t src, uintptr_t size, int flags) {
     uintptr_t end = dst + size;
     int max_class = addr_common_class(src, dst), class = 0, res;
     for (; class < max_class && dst + CLASS_SIZE(class) <= end; class ++) {
@@ -1458,31 +3647,92 @@ map_region(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspa
     return 0;
 }
 
+int
+map_region(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspace, uintptr_t src, uintptr_t size, int flags) {
+    if (src & CLASS_MASK(0) || (!sspace && !(flags & (ALLOC_ZERO | ALLOC_ONE)))) return -E_INVAL;
+    if (dst & CLASS_MASK(0) || !dspace) return -E_INVAL;
+    if (size & CLASS_MASK(0) || !size) return -E_INVAL;
+
+    /* FIXME This thing does not properly handle
+     * remapping overlapping regions to higher addresses */
+    assert(sspace != dspace || dst <= src || ABSDIFF(src, dst) >= size);
+
+    /* Replaced mappings are invalidated all at once */
+    tlb_gather_begin();
+    int res = do_map_region(dspace, dst, sspace, src, size, flags);
+    tlb_gather_end();
+    return res;
+}
+
 void
 release_address_space(struct AddressSpace *space) {
     /* NOTE: This function should not be called for kspace */
 
-    /* Manually unref level 3 kernel page tables */
-    for (size_t i = NUSERPML4; i < PML4_ENTRY_COUNT; i++) {
-        if (kspace.pml4[i] & PTE_P && i != UVPT_INDEX)
-            page_unref(page_lookup(NULL, PTE_ADDR(kspace.pml4[i]), 0, PARTIAL_NODE, 0));
-    }
-
     /* Unmap all memory from the space
      * (kernel is cheating and does not store
      *  metadata for upper part of address space (privileged)
      *  in tree and only in page tables for user address spaces,
      *  so unmapping is safe) */
+    tlb_gather_begin();
     unmap_page(space, 0, MAX_CLASS);
+    tlb_gather_end();
 
     /* Also unmap PML4 itself since it is never deallocated by page_uname*/
     page_unref(page_lookup(NULL, space->cr3, 0, PARTIAL_NODE, 0));
 
+    /* unmap_page() replaces root node with the new one */
+    space_index_del(space);
+    free_descriptor(space->root);
+    if (space->vdir) vdir_free(space->vdir, space->vdir_level);
+
+    /* Give back descriptor pools freed by address space destruction */
+    reclaim_pools();
+
     /* Zero-out metadata */
     memset(space, 0, sizeof *space);
 }
 
 
+/*
+ * Switches address space between virtual tree and metadata-light
+ * modes. Mode cannot be changed while user part of the space
+ * has any mappings (returns -E_INVAL then)
+ */
+int
+set_space_light(struct AddressSpace *space, bool light) {
+    if (space == &kspace || space->root->left || space->root->right) return -E_INVAL;
+    for (size_t i = 0; i < NUSERPML4; i++)
+        if (space->pml4[i] & PTE_P) return -E_INVAL;
+
+    space->light = light;
+    return 0;
+}
+
+/*
+ * Returns CR3 value loading address space.
+ * Every space is tagged with its own PCID, so its TLB entries
+ * survive switches and CR3 is loaded with NOFLUSH bit set.
+ * When PCIDs run out, new generation is started and all spaces
+ * get new PCIDs on their next switch. Newly assigned PCID
+ * is loaded without NOFLUSH, which drops entries left by its
+ * previous owner (or stale entries of the space itself)
+ */
+static uint64_t
+space_cr3(struct AddressSpace *space) {
+    if (!pcid_supported) return space->cr3;
+
+    if (space->pcid_gen == pcid_generation)
+        return space->cr3 | space->pcid | CR3_NOFLUSH;
+
+    if (pcid_next == MAX_PCID) {
+        pcid_generation++;
+        pcid_next = 1;
+    }
+    space->pcid = pcid_next++;
+    space->pcid_gen = pcid_generation;
+    return space->cr3 | space->pcid;
+}
+
 /*
  * This function is used for switch address spaces
  *
@@ -1505,8 +3755,10 @@ switch_address_space(struct AddressSpace *space) {
         return current_space;
     struct AddressSpace *old_space = current_space;
 
+    /* Pending invalidations belong to the old space */
+    tlb_gather_flush();
     current_space = space;
-    lcr3(current_space->cr3);
+    lcr3(space_cr3(current_space));
     return old_space;
 }
 
@@ -1528,13 +3780,23 @@ init_address_space(struct AddressSpace *space) {
     // of type INTERMEDIATE_NODE with alloc_rescriptosr() of type
     // LAB 8: Your code here
     space->root = alloc_descriptor(INTERMEDIATE_NODE);
+    space_index_add(space);
+    space->vdir = NULL;
+    space->light = 0;
+
+    space->numa_policy = NUMA_LOCAL;
+    space->fault_around = FAULT_AROUND_DEFAULT;
+    space->promote_pending = 0;
+    space->pcid_gen = 0;
+
+    /* Kernel half references PDPs shared with kspace,
+     * so kernel mappings are visible in every address space */
+    memcpy(space->pml4 + NUSERPML4, kspace.pml4 + NUSERPML4,
+           PAGE_SIZE - NUSERPML4 * sizeof(pml4e_t));
 
     /* Initialize UVPT */
     // LAB 8: Your code here
     space->pml4[PML4_INDEX(UVPT)] = space->cr3 | PTE_P | PTE_U;
-
-    /* Why this call is required here and what does it do? */
-    propagate_one_pml4(space, &kspace);
     return 0;
 }
 
@@ -1631,23 +3893,22 @@ detect_memory(void) {
 
 static void
 init_allocator(void) {
-    static struct Page initial_buffer[INIT_DESCR];
-
     metaheaptop = KERN_HEAP_START + ROUNDUP(uefi_lp->FrameBufferSize, PAGE_SIZE);
 
     /* Initiallize lists */
-    for (size_t i = 0; i < MAX_CLASS; i++)
-        list_init(&free_classes[i]);
+    for (size_t n = 0; n < MAX_NUMA_NODES; n++)
+        for (size_t i = 0; i < ZONE_COUNT; i++)
+            for (size_t j = 0; j < MAX_CLASS; j++)
+                list_init(&free_classes[n][i][j]);
 
     /* Initiallize first pool */
 
-    if (trace_memory_more) cprintf("First pool at [%08lX, %08lX]\n", PADDR(initial_buffer),
-                                   PADDR(initial_buffer) + INIT_DESCR * sizeof(struct Page));
+    if (trace_memory_more) cprintf("First pool at [%08lX, %08lX]\n", PADDR(initial_pool),
+                                   PADDR(initial_pool) + sizeof initial_pool);
 
-    list_init(&free_descriptors);
-    free_desc_count = INIT_DESCR;
-    for (size_t i = 0; i < INIT_DESCR; i++)
-        list_append(&free_descriptors, (struct List *)&initial_buffer[i]);
+    /* Initial pool is never released and is not in the list of pools */
+    list_init(&partial_pools);
+    add_pool((struct PagePool *)initial_pool, NULL);
 
     list_init(&root.head);
     root.class = MAX_CLASS;
@@ -1717,6 +3978,13 @@ init_kspace(void) {
     memset(kspace.pml4, 0, CLASS_SIZE(0));
     kspace.pml4[PML4_INDEX(UVPT)] = kspace.cr3 | PTE_P | PTE_U;
     kspace.root = alloc_descriptor(INTERMEDIATE_NODE);
+
+    /* Kernel half PML4 entries never change after this point,
+     * so address spaces only need to copy them once on creation */
+    for (size_t i = NUSERPML4; i < PML4_ENTRY_COUNT; i++) {
+        if (i != UVPT_INDEX && alloc_pt(kspace.pml4 + i) < 0)
+            panic("Cannot allocate kernel page tables");
+    }
 }
 
 #ifdef SANITIZE_SHADOW_BASE
@@ -1729,8 +3997,8 @@ unpoison_meta(struct Page *node) {
             return;
         }
 
-        if (node->left) unpoison_meta(node->left);
-        node = node->right;
+        if (node->left) unpoison_meta(pgptr(node->left));
+        node = pgptr(node->right);
     }
 }
 
@@ -1775,11 +4043,130 @@ map_kernel_region(uintptr_t dstart, uintptr_t pstart, size_t size, int flags) {
 
 }
 
+/* Returns NUMA node of proximity domain registering new node if needed */
+static int
+numa_domain_node(uint32_t domain, bool add) {
+    for (int i = 0; i < numa_node_count; i++)
+        if (numa_domains[i] == domain) return i;
+    if (!add || numa_node_count == MAX_NUMA_NODES) return -1;
+
+    numa_domains[numa_node_count] = domain;
+    return numa_node_count++;
+}
+
+/* Splits free page containing pa so that no free page crosses it */
+static void
+numa_split_at(physaddr_t pa) {
+    pa = ROUNDUP(pa, CLASS_SIZE(0));
+    if (!pa || pa >= max_memory_map_addr) return;
+
+    int class = MIN(__builtin_ctzll(pa) - CLASS_BASE, MAX_CLASS - 1);
+    struct Page *node = &root;
+    while (node->class > class && node->left)
+        node = pgptr(pa & CLASS_SIZE(node->class - 1) ? node->right : node->left);
+
+    /* pa is either start of existing node or lies within used page */
+    if (node->class == class || node->state != ALLOCATABLE_NODE ||
+        !PAGE_IS_FREE(node) || page_covered(node)) return;
+
+    struct Page *page = page_lookup(node, pa, class, PARTIAL_NODE, 1);
+    list_append(page_free_list(page), (struct List *)page);
+}
+
+/*
+ * Reads NUMA memory ranges and node of boot CPU from SRAT
+ * and redistributes free memory among nodes.
+ * Without SRAT all memory belongs to node 0
+ */
+static void
+numa_init(void) {
+    SRAT *srat = get_srat();
+    if (!srat) return;
+
+    uint32_t info, apic_id;
+    cpuid(1, NULL, &info, NULL, NULL);
+    apic_id = info >> 24;
+
+    numa_node_count = 0;
+    int64_t local_domain = -1;
+    uint8_t *end = (uint8_t *)srat + srat->h.Length;
+    for (uint8_t *ptr = srat->Entries; ptr + sizeof(SRATEntry) <= end;) {
+        SRATEntry *entry = (SRATEntry *)ptr;
+        if (!entry->Length) break;
+        ptr += entry->Length;
+
+        if (entry->Type == SRAT_MEMORY_AFFINITY) {
+            SRATMemoryAffinity *mem = (SRATMemoryAffinity *)entry;
+            if (!(mem->Flags & SRAT_ENABLED) || !mem->Length) continue;
+
+            int node = numa_domain_node(mem->ProximityDomain, 1);
+            if (node < 0 || numa_range_count == MAX_NUMA_RANGES) {
+                cprintf("NUMA: ignoring memory range [%08lX, %08lX]\n",
+                        (unsigned long)mem->BaseAddress, (unsigned long)(mem->BaseAddress + mem->Length - 1));
+                continue;
+            }
+            numa_ranges[numa_range_count++] = (struct NumaRange){
+                    .start = mem->BaseAddress,
+                    .end = mem->BaseAddress + mem->Length,
+                    .node = node};
+        } else if (entry->Type == SRAT_PROCESSOR_AFFINITY) {
+            SRATProcessorAffinity *cpu = (SRATProcessorAffinity *)entry;
+            if (cpu->Flags & SRAT_ENABLED && cpu->ApicId == apic_id)
+                local_domain = cpu->ProximityDomainLow | cpu->ProximityDomainHigh[0] << 8 |
+                               cpu->ProximityDomainHigh[1] << 16 | (uint32_t)cpu->ProximityDomainHigh[2] << 24;
+        } else if (entry->Type == SRAT_X2APIC_AFFINITY) {
+            SRATX2ApicAffinity *cpu = (SRATX2ApicAffinity *)entry;
+            if (cpu->Flags & SRAT_ENABLED && cpu->X2ApicId == apic_id)
+                local_domain = cpu->ProximityDomain;
+        }
+    }
+
+    if (!numa_node_count) {
+        numa_node_count = 1;
+        return;
+    }
+    if (local_domain >= 0) numa_local_node = MAX(numa_domain_node(local_domain, 0), 0);
+
+    /* No free page should cross node boundary */
+    for (size_t i = 0; i < numa_range_count; i++) {
+        numa_split_at(numa_ranges[i].start);
+        numa_split_at(numa_ranges[i].end);
+    }
+
+    /* Free memory was attached to node 0 */
+    for (int zone = 0; zone < ZONE_COUNT; zone++) {
+        for (int class = 0; class < MAX_CLASS; class++) {
+            struct List *list = &free_classes[0][zone][class];
+            for (struct List *li = listptr(list->next), *next; li != list; li = next) {
+                next = listptr(li->next);
+                struct List *target = page_free_list((struct Page *)li);
+                if (target != list) list_append(target, list_del(li));
+            }
+        }
+    }
+
+    /* Caches should only hold pages of the local node */
+    magazine_drain(this_magazine(), MAGAZINE_SIZE);
+    zero_cache_drain();
+
+    cprintf("NUMA: %d nodes, boot CPU is on node %d\n", numa_node_count, numa_local_node);
+    if (trace_init) {
+        for (size_t i = 0; i < numa_range_count; i++)
+            cprintf("  node %d: [%08lX, %08lX]\n", numa_ranges[i].node,
+                    (unsigned long)numa_ranges[i].start, (unsigned long)numa_ranges[i].end - 1);
+    }
+}
+
 void
 init_memory(void) {
     int res;
     (void)res;
 
+    uint32_t ecx, edx;
+    cpuid(1, NULL, NULL, &ecx, &edx);
+    pge_supported = edx & CPUID_PGE;
+    pcid_supported = ecx & CPUID_PCID;
+
     init_allocator();
     if (trace_init) cprintf("Memory allocator is initiallized\n");
 
@@ -1812,6 +4199,12 @@ init_memory(void) {
     // Map [PADDR(__text_start);PADDR(__text_end)] to [__text_start, __text_end] as RW-
     map_kernel_region((uintptr_t)__text_start, PADDR(__text_start), __text_end - __text_start, PROT_RWX);
 
+    /* Embedded program images are mapped to environments directly (see load_icode()),
+     * so keep them referenced by kspace and read-only */
+    extern char __binary_start[], __binary_end[];
+    if ((uintptr_t)__binary_end > (uintptr_t)__binary_start)
+        map_kernel_region((uintptr_t)__binary_start, PADDR(__binary_start), __binary_end - __binary_start, PROT_R);
+
     /* Allocate kernel stacks */
 
     // LAB 7: Your code here
@@ -1848,7 +4241,12 @@ init_memory(void) {
     /* Set appropriate cr0 and cr4 bits
      * (In assembly code only minimal set of modes was set)*/
     lcr0(CR0_PE | CR0_PG | CR0_AM | CR0_WP | CR0_NE | CR0_MP);
-    lcr4(CR4_PSE | CR4_PAE | CR4_PCE);
+    lcr4(CR4_PSE | CR4_PAE | CR4_PCE | (pge_supported ? CR4_PGE : 0));
+    /* PCIDs can only be enabled with PCID 0 loaded */
+    if (pcid_supported && !(rcr3() & CR3_PCID_MASK))
+        lcr4(rcr4() | CR4_PCIDE);
+    else
+        pcid_supported = 0;
 
     /* Enable NX bit (execution protection) */
     uint64_t efer = rdmsr(EFER_MSR);
@@ -1858,6 +4256,8 @@ init_memory(void) {
     for (size_t i = 0; i < CLASS_SIZE(MAX_ALLOCATION_CLASS); i++) assert(!zero_page_raw[i]);
 
     switch_address_space(&kspace);
+    /* Drop global entries left by the loader */
+    tlb_flush_global();
 
     /* One page is a page filled with 0xFF values -- ASAN poison */
     nosan_memset(one_page_raw, 0xFF, CLASS_SIZE(MAX_ALLOCATION_CLASS));
@@ -1917,6 +4317,10 @@ init_memory(void) {
 
     if (trace_memory_more) dump_page_table(kspace.pml4);
 
+    /* ACPI tables are mapped with mmio_map_region(),
+     * so NUMA configuration is read at the very end */
+    numa_init();
+
     check_physical_tree(&root);
     if (trace_init) cprintf("Physical memory tree is stil correct\n");
 
@@ -1931,11 +4335,9 @@ static uintptr_t user_mem_check_addr;
  * has specified permissions and sets user_mem_check_addr
  * to first non-applicable address
  *
- * HINT: Use page_lookup_virtual with class==0 alloc==0 to
- * lookup the smallest existing page at the given address.
- *
- * Returned page should have associated physical page
- * and permissions set as bits in state field.
+ * Region is walked mapping by mapping with mapping_walk(),
+ * so protection is checked once for every mapping
+ * instead of every page.
  *
  * Return 0 if check is passed or -E_FAULT if region
  * does not have enough permissions.
@@ -1943,30 +4345,38 @@ static uintptr_t user_mem_check_addr;
 int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm) {
     // LAB 8: Your code here
-    const void *current = (void *)ROUNDDOWN(va, PAGE_SIZE);
-    const void *end = va + len;
-    struct Page *user_root = env->address_space.root;
+    uintptr_t current = ROUNDDOWN((uintptr_t)va, PAGE_SIZE);
+    uintptr_t end = (uintptr_t)va + len;
+    if (end > MAX_USER_READABLE || end < (uintptr_t)va) {
+        user_mem_check_addr = MAX(MAX_USER_READABLE, (uintptr_t)va);
+        return -E_FAULT;
+    }
+
+    struct PageCursor cur;
+    cursor_init(&cur, &env->address_space);
     while (current < end) {
-        struct Page *page = page_lookup_virtual(user_root, (uintptr_t)current, 0, 0);
-        if (!page->phy || (page->state & PAGE_PROT(perm)) != PAGE_PROT(perm)) {
-            user_mem_check_addr = (uintptr_t)(MAX(va, current));
+        uintptr_t next;
+        int prot;
+        if (!mapping_walk(&cur, current, &prot, &next) || (prot & PAGE_PROT(perm)) != PAGE_PROT(perm)) {
+            user_mem_check_addr = MAX((uintptr_t)va, current);
             return -E_FAULT;
         }
-        current += PAGE_SIZE;
-    }
-    if ((uintptr_t)end > MAX_USER_READABLE) {
-        user_mem_check_addr = MAX(MAX_USER_READABLE, (uintptr_t)current);
-        return -E_FAULT;
+        current = next;
     }
     return 0;
 }
 
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm) {
-    if (user_mem_check(env, va, len, perm | PROT_USER_) < 0) {
-        cprintf("[%08x] user_mem_check assertion failure for "
-                "va=%016zx ip=%016zx\n",
-                env->env_id, user_mem_check_addr, env->env_tf.tf_rip);
-        env_destroy(env); /* may not return */
-    }
+    if (user_mem_check(env, va, len, perm | PROT_USER_) < 0)
+        user_mem_fault(env, user_mem_check_addr);
+}
+
+/* Reports invalid user memory access at va and destroys env */
+void
+user_mem_fault(struct Env *env, uintptr_t va) {
+    cprintf("[%08x] user_mem_check assertion failure for "
+            "va=%016zx ip=%016zx\n",
+            env->env_id, va, env->env_tf.tf_rip);
+    env_destroy(env); /* may not return */
 }
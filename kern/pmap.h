@@ -66,6 +66,11 @@ void __nosan_memmove(void *, void *, size_t);
 /* Maximal size of page allocated on pagefault */
 #define MAX_ALLOCATION_CLASS 9
 
+/* Lazy pages are allocated in aligned windows of
+ * 2^fault_around pages on page faults (0 disables this) */
+#define FAULT_AROUND_DEFAULT 4
+#define FAULT_AROUND_MAX     MAX_ALLOCATION_CLASS
+
 enum PageState {
     MAPPING_NODE = 0x100000,      /* Memory mapping (part of virtual tree) */
     INTERMEDIATE_NODE = 0x200000, /* Intermediate node of virtual memory tree */
@@ -78,41 +83,152 @@ enum PageState {
 extern __attribute__((aligned(HUGE_PAGE_SIZE))) uint8_t zero_page_raw[HUGE_PAGE_SIZE];
 extern __attribute__((aligned(HUGE_PAGE_SIZE))) uint8_t one_page_raw[HUGE_PAGE_SIZE];
 
+/*
+ * Descriptors and free list heads are linked with compact
+ * 32-bit links instead of pointers. Link is an offset from
+ * KERN_BASE_ADDR in PAGE_LINK_UNIT units, so all linked objects
+ * should reside within first PAGE_LINK_LIMIT bytes of the
+ * direct mapping (descriptor pools are always taken from boot memory).
+ * Link 0 corresponds to NULL since the first page is never used for that.
+ */
+typedef uint32_t pglink_t;
+
+#define PAGE_LINK_UNIT  8
+#define PAGE_LINK_LIMIT ((uintptr_t)PAGE_LINK_UNIT << 32)
+
+struct List {
+    pglink_t prev, next;
+};
+
+/* Maximal reference count of physical page */
+#define MAX_REFC ((1U << 27) - 1)
+
 struct Page {
-    struct List head; /* This should be first member */
-    struct Page *left, *right, *parent;
-    enum PageState state;
+    struct List head;             /* This should be first member */
+    pglink_t left, right, parent; /* Tree links */
+    uint32_t state : 24;          /* enum PageState and protection flags */
+    uint32_t class : 8;           /* = log2(size)-CLASS_BASE */
     union {
         struct /* physical page */ {
             /* Number of references
              * Child nodes always have class
              * smaller by 1 than their parents */
-            uint32_t refc;
-            uintptr_t class : CLASS_BASE;                        /* = log2(size)-CLASS_BASE */
-            uintptr_t addr : sizeof(uintptr_t) * 8 - CLASS_BASE; /* = address >> CLASS_BASE */
+            uint64_t refc : 27;
+            /* Reference of the page as a whole is not
+             * yet propagated to its children */
+            uint64_t lazy_ref : 1;
+            uint64_t index : 36; /* = address >> (class + CLASS_BASE) */
+        };
+        struct /* mapping */ {
+            pglink_t phy; /* If phy == 0 this is intemediate page */
+            /* Maximal reference count of pages mapped within
+             * the subtree, only valid if maxref_gen is current */
+            uint16_t maxref;
+            uint16_t maxref_gen;
         };
-        /* mapping */
-        struct Page *phy; /* If phy == NULL this is intemediate page */
     };
 };
 
+static_assert(sizeof(struct Page) == 32, "Page descriptor should be 32 bytes long");
+
 struct PagePool {
     struct Page *peer;     /* Page from which memory is taken */
     struct PagePool *next; /* Next pool link */
-    struct Page data[];    /* Page descriptors storage */
+    struct List free;      /* Free descriptors of this pool */
+    struct List partial;   /* Link in list of pools with free descriptors */
+    size_t used;           /* Number of allocated descriptors */
+    /* Page descriptors storage (cache line aligned,
+     * so that descriptors do not cross cache lines) */
+    struct Page data[] __attribute__((aligned(64)));
+};
+
+/* Number of pages in per-CPU magazine */
+#define MAGAZINE_SIZE 64
+/* Number of pages moved between magazine and buddy tree at once */
+#define MAGAZINE_BATCH 32
+
+/* Per-CPU cache of referenced standalone 4K pages */
+struct PageMagazine {
+    size_t count;
+    struct Page *pages[MAGAZINE_SIZE];
+};
+
+/* Position in virtual memory tree remembered between lookups */
+struct PageCursor {
+    struct AddressSpace *space;
+    struct Page *node; /* Last found node */
+    uintptr_t addr;    /* Address of the node */
+    int class;         /* Class of the node */
+};
+
+/* Number of levels of virtual tree radix index (PML4, PDP and PD) */
+#define VDIR_LEVELS  3
+#define VDIR_ENTRIES 512
+
+/* Class of virtual tree nodes kept at radix index level */
+#define VDIR_CLASS(level) (27 - 9 * (level))
+/* Addresses covered by radix index */
+#define VDIR_LIMIT CLASS_SIZE(VDIR_CLASS(0) + 9)
+
+/* Directory of virtual tree radix index (one page),
+ * the entries match page table entries of the same level */
+struct VirtualDir {
+    pglink_t nodes[VDIR_ENTRIES]; /* Virtual tree nodes of the level class */
+    uint32_t next[VDIR_ENTRIES];  /* Page frame numbers of lower level directories */
+};
+
+static_assert(sizeof(struct VirtualDir) == PAGE_SIZE, "Radix directory should take one page");
+
+/* Maximal number of separate ranges kept by TLB gather */
+#define TLB_GATHER_RANGES 16
+
+/* Range of removed translations */
+struct TlbRange {
+    uintptr_t start, end;
+    size_t granule; /* Smallest size of removed pages */
+};
+
+/* TLB invalidations accumulated during a memory operation,
+ * flushed all at once when the operation finishes */
+struct TlbGather {
+    int depth;     /* Nesting of gathering operations */
+    bool global;   /* Global kernel translations were removed */
+    bool overflow; /* Ranges do not fit, whole TLB should be flushed */
+    size_t count;
+    struct TlbRange ranges[TLB_GATHER_RANGES];
+};
+
+/* Maximal number of pre-zeroed pages of one class */
+#define ZERO_CACHE_SIZE 64
+/* Number of bytes zeroed per zero_cache_refill() call */
+#define ZERO_CACHE_REFILL (2 * MB)
+
+/* Cache of pre-zeroed referenced pages of one class */
+struct ZeroCache {
+    size_t count;
+    struct Page *pages[ZERO_CACHE_SIZE];
 };
 
 int map_region(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspace, uintptr_t src, uintptr_t size, int flags);
-void unmap_region(struct AddressSpace *dspace, uintptr_t dst, uintptr_t size);
+int unmap_region(struct AddressSpace *dspace, uintptr_t dst, uintptr_t size);
+int map_kernel_lazy(struct AddressSpace *spc, uintptr_t dst, const void *src, size_t size, int flags);
+int map_kernel_copy(struct AddressSpace *spc, uintptr_t dst, const void *src, size_t size, int flags);
 void init_memory(void);
 void release_address_space(struct AddressSpace *space);
 struct AddressSpace *switch_address_space(struct AddressSpace *space);
 int init_address_space(struct AddressSpace *space);
+int set_space_light(struct AddressSpace *space, bool light);
 void user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+void user_mem_fault(struct Env *env, uintptr_t va);
 int region_maxref(struct AddressSpace *spc, uintptr_t addr, size_t size);
-int force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass);
+int force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass, bool user);
 void dump_page_table(pte_t *pml4);
 void dump_memory_lists(void);
+void dump_memory_stats(void);
+void zero_cache_refill(void);
+void compact_memory(void);
+void promote_huge_page(struct AddressSpace *spc, uintptr_t va);
+void promote_memory(void);
 void dump_virtual_tree(struct Page *node, int class);
 
 void *kzalloc_region(size_t size);
@@ -163,7 +279,25 @@ _kaddr(const char *file, int line, physaddr_t pa) {
 
 inline static physaddr_t __attribute__((always_inline))
 page2pa(struct Page *page) {
-    return page->addr << CLASS_BASE;
+    return (physaddr_t)page->index << (page->class + CLASS_BASE);
+}
+
+inline static pglink_t __attribute__((always_inline))
+pglink(const void *ptr) {
+    if (!ptr) return 0;
+    uintptr_t offset = (uintptr_t)ptr - KERN_BASE_ADDR;
+    assert(offset < PAGE_LINK_LIMIT);
+    return offset / PAGE_LINK_UNIT;
+}
+
+inline static struct Page *__attribute__((always_inline))
+pgptr(pglink_t link) {
+    return link ? (struct Page *)(KERN_BASE_ADDR + (uintptr_t)link * PAGE_LINK_UNIT) : NULL;
+}
+
+inline static struct List *__attribute__((always_inline))
+listptr(pglink_t link) {
+    return (struct List *)pgptr(link);
 }
 
 inline static void
@@ -2,6 +2,7 @@
 #include <inc/x86.h>
 #include <kern/env.h>
 #include <kern/monitor.h>
+#include <kern/pmap.h>
 
 
 struct Taskstate cpu_ts;
@@ -69,6 +70,12 @@ sched_halt(void) {
     /* Mark that no environment is running on CPU */
     curenv = NULL;
 
+    /* Use idle time to prepare zero-filled pages */
+    zero_cache_refill();
+    /* ...and to re-form huge pages */
+    compact_memory();
+    promote_memory();
+
     /* Reset stack pointer, enable interrupts and then halt */
     asm volatile(
             "movq $0, %%rbp\n"
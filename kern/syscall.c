@@ -13,6 +13,10 @@
 #include <kern/syscall.h>
 #include <kern/trap.h>
 #include <kern/traceopt.h>
+#include <kern/uaccess.h>
+
+/* Number of bytes printed by sys_cputs() at once */
+#define CPUTS_CHUNK 256
 
 /* Print a string to the system console.
  * The string is exactly 'len' characters long.
@@ -20,13 +24,15 @@
 static int
 sys_cputs(const char *s, size_t len) {
     // LAB 8: Your code here
-#ifdef SANITIZE_SHADOW_BASE
-    platform_asan_unpoison((void *)s, ROUNDUP(len + 1, 4096));
-#endif
-    /* Check that the user has permission to read memory [s, s+len).
-    * Destroy the environment if not. */
-    user_mem_assert(curenv, s, len, PROT_R | PROT_USER_);
-    cprintf("%.*s", (int)len, s);
+    /* String is copied in chunks, so invalid memory is
+     * detected by copyin() without walking mappings first */
+    char buf[CPUTS_CHUNK];
+    for (size_t i = 0; i < len; i += CPUTS_CHUNK) {
+        size_t n = MIN(len - i, CPUTS_CHUNK);
+        size_t left = copyin(buf, s + i, n);
+        if (left) user_mem_fault(curenv, (uintptr_t)s + i + n - left);
+        cprintf("%.*s", (int)n, buf);
+    }
     return 0;
 }
 
@@ -98,9 +104,85 @@ sys_exofork(void) {
     env->env_status = ENV_NOT_RUNNABLE;
     env->env_tf = curenv->env_tf;
     env->env_tf.tf_regs.reg_rax = 0;
+    env->address_space.numa_policy = curenv->address_space.numa_policy;
+    env->address_space.fault_around = curenv->address_space.fault_around;
+    env->address_space.light = curenv->address_space.light;
     return env->env_id;
 }
 
+/* Create a copy of the current environment in one call.
+ * The new environment is created like with sys_exofork(), gets
+ * lazy copy of user address space (as if it was copied with
+ * PROT_LAZY | PROT_COMBINE), the page fault upcall of the current
+ * environment, and is made runnable only when all of it succeeds.
+ * Returns envid of new environment, or < 0 on error.  Errors are:
+ *  -E_NO_FREE_ENV if no free environment is available.
+ *  -E_NO_MEM on memory exhaustion. */
+static envid_t
+sys_fork(void) {
+    envid_t envid = sys_exofork();
+    if (envid < 0)
+        return envid;
+
+    struct Env *env = &envs[ENVX(envid)];
+    int res = map_region(&env->address_space, 0, &curenv->address_space, 0,
+                         MAX_USER_ADDRESS, PROT_ALL | PROT_LAZY | PROT_COMBINE);
+    if (res < 0) {
+        env_destroy(env);
+        return res;
+    }
+    env->env_pgfault_upcall = curenv->env_pgfault_upcall;
+    env->env_status = ENV_RUNNABLE;
+    return envid;
+}
+
+/* Create a new environment running program image embedded into the kernel,
+ * named after its path (like "user/hello"), with NULL-terminated argument
+ * list argv. The image is loaded directly, the address space of the current
+ * environment is never copied.
+ * Returns envid of new environment, or < 0 on error.  Errors are:
+ *  -E_NO_ENT if there is no such image.
+ *  -E_INVAL if name or arguments are too long.
+ *  -E_FAULT if name or arguments are not accessible.
+ *  -E_NO_FREE_ENV if no free environment is available.
+ *  -E_NO_MEM on memory exhaustion.
+ *  -E_INVALID_EXE if image is not a valid executable. */
+static envid_t
+sys_spawn(const char *uname, const char **uargv) {
+    char name[SPAWN_NAME_MAX];
+    static char args[SPAWN_ARGS_SIZE];
+
+    long len = strncpy_from_user(name, uname, sizeof(name));
+    if (len < 0)
+        return len;
+    if (len == sizeof(name) - 1)
+        return -E_INVAL;
+
+    /* Arguments are stored one after another */
+    size_t size = 0;
+    int argc = 0;
+    for (; uargv; argc++) {
+        const char *arg;
+        if (copyin(&arg, uargv + argc, sizeof(arg)))
+            return -E_FAULT;
+        if (!arg)
+            break;
+        if (argc == SPAWN_ARGC_MAX)
+            return -E_INVAL;
+
+        len = strncpy_from_user(args + size, arg, sizeof(args) - size);
+        if (len < 0)
+            return len;
+        if (len >= (long)(sizeof(args) - size) - 1)
+            return -E_INVAL;
+        size += len + 1;
+    }
+
+    struct Env *env;
+    int res = env_spawn(&env, name, argc, args, size);
+    return res < 0 ? res : env->env_id;
+}
+
 /* Set envid's env_status to status, which must be ENV_RUNNABLE
  * or ENV_NOT_RUNNABLE.
  *
@@ -231,8 +313,7 @@ sys_map_region(envid_t srcenvid, uintptr_t srcva,
 
     perm |= PROT_USER_;
 
-    return map_region(&dstenv->address_space, dstva, &srcenv->address_space, srcva, size, perm) ?
-        -E_NO_MEM : 0;
+    return map_region(&dstenv->address_space, dstva, &srcenv->address_space, srcva, size, perm);
 }
 
 /* Unmap the region of memory at 'va' in the address space of 'envid'.
@@ -241,7 +322,9 @@ sys_map_region(envid_t srcenvid, uintptr_t srcva,
  * Return 0 on success, < 0 on error.  Errors are:
  *  -E_BAD_ENV if environment envid doesn't currently exist,
  *      or the caller doesn't have permission to change envid.
- *  -E_INVAL if va >= MAX_USER_ADDRESS, or va is not page-aligned. */
+ *  -E_INVAL if va >= MAX_USER_ADDRESS, or va is not page-aligned.
+ *  -E_NO_MEM if mapping of light space partially covered
+ *      by the region cannot be split. */
 static int
 sys_unmap_region(envid_t envid, uintptr_t va, size_t size) {
     /* Hint: This function is a wrapper around unmap_region(). */
@@ -254,8 +337,7 @@ sys_unmap_region(envid_t envid, uintptr_t va, size_t size) {
     if (CLASS_MASK(0) & va || va >= MAX_USER_ADDRESS)
         return -E_INVAL;
 
-    unmap_region(&env->address_space, va, size);
-    return 0;
+    return unmap_region(&env->address_space, va, size);
 }
 
 /* Try to send 'value' to the target env 'envid'.
@@ -362,6 +444,65 @@ sys_ipc_recv(uintptr_t dstva, uintptr_t maxsize) {
     return 0;
 }
 
+/* Set NUMA placement policy of envid's address space.
+ * New memory of the space is taken from the local node
+ * (NUMA_LOCAL) or spread over all nodes (NUMA_INTERLEAVE).
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid.
+ *  -E_INVAL if policy is not a valid policy. */
+static int
+sys_set_mempolicy(envid_t envid, int policy) {
+    struct Env *env;
+    if (envid2env(envid, &env, 1))
+        return -E_BAD_ENV;
+
+    if (policy < 0 || policy >= NUMA_POLICY_COUNT)
+        return -E_INVAL;
+    env->address_space.numa_policy = policy;
+    return 0;
+}
+
+/* Set fault-around window of envid's address space.
+ * Page fault on lazily allocated zero or one filled region
+ * allocates pages within aligned window of 2^order pages
+ * (order 0 disables fault-around).
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid.
+ *  -E_INVAL if order is larger than FAULT_AROUND_MAX. */
+static int
+sys_set_fault_around(envid_t envid, int order) {
+    struct Env *env;
+    if (envid2env(envid, &env, 1))
+        return -E_BAD_ENV;
+
+    if (order < 0 || order > FAULT_AROUND_MAX)
+        return -E_INVAL;
+    env->address_space.fault_around = order;
+    return 0;
+}
+
+/* Switch envid's address space between virtual tree and metadata-light
+ * modes. Mappings of light address space are stored only in page tables,
+ * which saves memory spent on virtual tree. Children created by
+ * sys_exofork() inherit the mode.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid.
+ *  -E_INVAL if user part of envid's address space is not empty. */
+static int
+sys_set_space_light(envid_t envid, bool light) {
+    struct Env *env;
+    if (envid2env(envid, &env, 1))
+        return -E_BAD_ENV;
+
+    return set_space_light(&env->address_space, light);
+}
+
 /*
  * This function return the difference between maximal
  * number of references of regions [addr, addr + size] and [addr2,addr2+size2]
@@ -373,7 +514,10 @@ sys_ipc_recv(uintptr_t dstva, uintptr_t maxsize) {
 static int
 sys_region_refs(uintptr_t addr, size_t size, uintptr_t addr2, uintptr_t size2) {
     // LAB 10: Your code here
-    return 0;
+    int res = region_maxref(&curenv->address_space, addr, size);
+    if (addr2 < MAX_USER_ADDRESS)
+        res -= region_maxref(&curenv->address_space, addr2, size2);
+    return res;
 }
 
 /* Dispatches to the correct kernel function, passing the arguments. */
@@ -395,6 +539,10 @@ syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t
     // LAB 9: Your code here
     case SYS_exofork:
         return sys_exofork();
+    case SYS_fork:
+        return sys_fork();
+    case SYS_spawn:
+        return sys_spawn((const char *)a1, (const char **)a2);
     case SYS_alloc_region:
         return sys_alloc_region((envid_t)a1, a2, (size_t)a3, (int)a4);
     case SYS_map_region:
@@ -412,6 +560,14 @@ syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t
         return sys_ipc_try_send((envid_t)a1, (uint32_t)a2, a3,(size_t)a4,(int)a5);
     case SYS_ipc_recv:
         return sys_ipc_recv(a1, a2);
+    case SYS_set_mempolicy:
+        return sys_set_mempolicy((envid_t)a1, (int)a2);
+    case SYS_set_fault_around:
+        return sys_set_fault_around((envid_t)a1, (int)a2);
+    case SYS_set_space_light:
+        return sys_set_space_light((envid_t)a1, (bool)a2);
+    case SYS_region_refs:
+        return sys_region_refs(a1, (size_t)a2, a3, (size_t)a4);
     default:
         return -E_NO_SYS;
     }
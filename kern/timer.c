@@ -195,6 +195,19 @@ get_hpet(void) {
     return khpet;
 }
 
+/* Obtain and map SRAT ACPI table address (it is optional). */
+SRAT *
+get_srat(void) {
+    static SRAT *ksrat;
+    static bool searched;
+    if (!searched) {
+        ksrat = acpi_find_table("SRAT");
+        searched = 1;
+    }
+
+    return ksrat;
+}
+
 /* Getting physical HPET timer address from its table. */
 HPETRegister *
 hpet_register(void) {
@@ -170,12 +170,64 @@ typedef struct {
     uint8_t Reserved3[3];
 } FADT;
 
+/* System Resource Affinity Table */
+typedef struct {
+    ACPISDTHeader h;
+    uint32_t Reserved1;
+    uint64_t Reserved2;
+    uint8_t Entries[];
+} SRAT;
+
+/* SRAT entry types */
+#define SRAT_PROCESSOR_AFFINITY   0
+#define SRAT_MEMORY_AFFINITY      1
+#define SRAT_X2APIC_AFFINITY      2
+/* Entry flags */
+#define SRAT_ENABLED 1
+
+typedef struct {
+    uint8_t Type;
+    uint8_t Length;
+} SRATEntry;
+
+typedef struct {
+    SRATEntry h;
+    uint8_t ProximityDomainLow;
+    uint8_t ApicId;
+    uint32_t Flags;
+    uint8_t SapicEid;
+    uint8_t ProximityDomainHigh[3];
+    uint32_t ClockDomain;
+} SRATProcessorAffinity;
+
+typedef struct {
+    SRATEntry h;
+    uint32_t ProximityDomain;
+    uint16_t Reserved1;
+    uint64_t BaseAddress;
+    uint64_t Length;
+    uint32_t Reserved2;
+    uint32_t Flags;
+    uint64_t Reserved3;
+} SRATMemoryAffinity;
+
+typedef struct {
+    SRATEntry h;
+    uint16_t Reserved1;
+    uint32_t ProximityDomain;
+    uint32_t X2ApicId;
+    uint32_t Flags;
+    uint32_t ClockDomain;
+    uint32_t Reserved2;
+} SRATX2ApicAffinity;
+
 #pragma pack(pop)
 
 void acpi_enable(void);
 RSDP *get_rsdp(void);
 FADT *get_fadt(void);
 HPET *get_hpet(void);
+SRAT *get_srat(void);
 
 void hpet_print_struct(void);
 void hpet_init(void);
@@ -14,6 +14,7 @@
 #include <kern/picirq.h>
 #include <kern/timer.h>
 #include <kern/traceopt.h>
+#include <kern/uaccess.h>
 
 static struct Taskstate ts;
 
@@ -354,7 +355,10 @@ trap(struct Trapframe *tf) {
          * which can happen with curenv == NULL */
 
         /* Read processor's CR2 register to find the faulting address */
-        int res = force_alloc_page(current_space, va, MAX_ALLOCATION_CLASS);
+        int res = force_alloc_page(current_space, va, MAX_ALLOCATION_CLASS, tf->tf_err & FEC_U);
+        /* User mode faults cannot interrupt memory management code,
+         * so faulted page can be merged into huge page right away */
+        if (!res && tf->tf_err & FEC_U) promote_huge_page(current_space, va);
         if (trace_pagefaults) {
             bool can_redir = tf->tf_err & FEC_U && curenv && curenv->env_pgfault_upcall;
             cprintf("<%p> Page fault ip=%08lX va=%08lX err=%c%c%c%c%c -> %s\n", current_space, tf->tf_rip, va,
@@ -369,6 +373,14 @@ trap(struct Trapframe *tf) {
             in_page_fault = 0;
             env_pop_tf(tf);
         }
+
+        /* Invalid accesses of user memory accessors fail at their fixup code */
+        uintptr_t fixup = tf->tf_err & FEC_U ? 0 : search_exception_table(tf->tf_rip);
+        if (fixup) {
+            tf->tf_rip = fixup;
+            in_page_fault = 0;
+            env_pop_tf(tf);
+        }
     }
 
     assert(curenv);
@@ -458,11 +470,6 @@ page_fault_handler(struct Trapframe *tf) {
         env_destroy(curenv);
     }
 
-    /* Force allocation of exception stack page to prevent memcpy from
-     * causing pagefault during another pagefault */
-    // LAB 9: Your code here:
-    force_alloc_page(&curenv->address_space, USER_EXCEPTION_STACK_TOP - PAGE_SIZE, PAGE_SIZE);
-
     /* Assert existance of exception stack using user mem assert */
     // LAB 9: Your code here:
     uintptr_t ursp;
@@ -474,6 +481,13 @@ page_fault_handler(struct Trapframe *tf) {
     ursp -= sizeof(struct UTrapframe);
     user_mem_assert(curenv, (void *)ursp, sizeof(struct UTrapframe), PROT_W);
 
+    /* Force allocation of every page covered by UTrapframe to prevent copyout()
+     * from causing pagefault during another pagefault (this handler runs on
+     * page fault stack, so nested faults cannot be handled even with fixups) */
+    // LAB 9: Your code here:
+    for (uintptr_t addr = ROUNDDOWN(ursp, PAGE_SIZE); addr < ursp + sizeof(struct UTrapframe); addr += PAGE_SIZE)
+        force_alloc_page(&curenv->address_space, addr, MAX_ALLOCATION_CLASS, 0);
+
     /* Build local copy of UTrapframe */
     // LAB 9: Your code here:   
     struct UTrapframe utf;
@@ -486,18 +500,17 @@ page_fault_handler(struct Trapframe *tf) {
     tf->tf_rsp        = ursp;
     tf->tf_rip        = (uintptr_t)curenv->env_pgfault_upcall;
 
-    /* And then copy it userspace (nosan_memcpy) */
+    /* And then copy it userspace
+     * (without switching address space and disabling write protection) */
     // LAB 9: Your code here:
-    struct AddressSpace *old = switch_address_space(&curenv->address_space);
-    set_wp(0);
-    nosan_memcpy((void *)(ursp), (void *)&utf, sizeof(struct UTrapframe));
-    set_wp(1);
-    switch_address_space(old);
+    assert(current_space == &curenv->address_space);
+    size_t left = copyout((void *)ursp, &utf, sizeof(struct UTrapframe));
+    if (left) user_mem_fault(curenv, ursp + sizeof(struct UTrapframe) - left);
+
     /* Reset in_page_fault flag */
     // LAB 9: Your code here:
-    if (envs->env_tf.tf_trapno == T_PGFLT)
-        in_page_fault = 0;
-    
+    in_page_fault = 0;
+
     /* Rerun current environment */
     // LAB 9: Your code here:
 
@@ -0,0 +1,82 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/error.h>
+#include <inc/memlayout.h>
+#include <inc/string.h>
+#include <kern/uaccess.h>
+
+/*
+ * User memory is accessed directly without checking its mappings first.
+ * Lazy pages are allocated by page fault handler as usual, and faults
+ * that cannot be resolved at instructions listed in exception table
+ * continue at their fixup addresses (see trap()), so invalid
+ * accesses just stop the copy instead of panicking.
+ */
+
+extern struct ExceptionEntry __ex_table_start[], __ex_table_end[];
+
+/* Returns fixup address for faulting instruction or 0 */
+uintptr_t
+search_exception_table(uintptr_t rip) {
+    for (struct ExceptionEntry *entry = __ex_table_start; entry < __ex_table_end; entry++)
+        if (entry->insn == rip) return entry->fixup;
+    return 0;
+}
+
+/* Copies len bytes and returns number of bytes not copied
+ * (faulted rep movsb is resumed right after itself
+ * with rcx holding the remaining count) */
+static size_t
+copy_user(void *dst, const void *src, size_t len) {
+    asm volatile("1: rep movsb\n"
+                 "2:\n"
+                 ".pushsection __ex_table, \"a\"\n"
+                 ".balign 8\n"
+                 ".quad 1b, 2b\n"
+                 ".popsection"
+                 : "+D"(dst), "+S"(src), "+c"(len)::"memory");
+    return len;
+}
+
+/* Returns length of the part of [uaddr, uaddr + len) below limit.
+ * User can read up to MAX_USER_READABLE, but write only below
+ * MAX_USER_ADDRESS, since mappings above it are kernel-owned */
+static size_t
+user_range(const void *uaddr, size_t len, uintptr_t limit) {
+    uintptr_t va = (uintptr_t)uaddr;
+    return va < limit ? MIN(len, limit - va) : 0;
+}
+
+size_t
+copyin(void *dst, const void *usrc, size_t len) {
+    size_t n = user_range(usrc, len, MAX_USER_READABLE);
+    return len - n + copy_user(dst, usrc, n);
+}
+
+size_t
+copyout(void *udst, const void *src, size_t len) {
+    size_t n = user_range(udst, len, MAX_USER_ADDRESS);
+    return len - n + copy_user(udst, src, n);
+}
+
+/* Copies NUL-terminated string to buffer of size bytes,
+ * truncating it if required. Returns string length or -E_FAULT */
+long
+strncpy_from_user(char *dst, const char *usrc, size_t size) {
+    if (!size) return 0;
+
+    /* String is copied in chunks not crossing page boundaries,
+     * so that bytes past its end are only read within the last page */
+    size_t i = 0;
+    while (i < size - 1) {
+        uintptr_t va = (uintptr_t)usrc + i;
+        size_t chunk = MIN(size - 1 - i, PAGE_SIZE - (va & (PAGE_SIZE - 1)));
+        if (copyin(dst + i, usrc + i, chunk)) return -E_FAULT;
+
+        size_t len = strnlen(dst + i, chunk);
+        if (len < chunk) return i + len;
+        i += chunk;
+    }
+    dst[size - 1] = '\0';
+    return size - 1;
+}
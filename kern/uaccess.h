@@ -0,0 +1,25 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_UACCESS_H
+#define JOS_KERN_UACCESS_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+/* Exception table entry: page fault at insn continues at fixup */
+struct ExceptionEntry {
+    uintptr_t insn;
+    uintptr_t fixup;
+};
+
+uintptr_t search_exception_table(uintptr_t rip);
+
+/* Accessors of user memory of the current address space.
+ * copyin() and copyout() return number of bytes not copied */
+size_t copyin(void *dst, const void *usrc, size_t len);
+size_t copyout(void *udst, const void *src, size_t len);
+long strncpy_from_user(char *dst, const char *usrc, size_t size);
+
+#endif /* !JOS_KERN_UACCESS_H */
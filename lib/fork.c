@@ -11,13 +11,27 @@
  * Returns: child's envid to the parent, 0 to the child, < 0 on error.
  * It is also OK to panic on error.
  *
- * Hint:
- *   Use sys_map_region, it can perform address space copying in one call
- *   Remember to fix "thisenv" in the child process.
+ * All of it is done by sys_fork() in a single system call
+ * (see user/forkbench for comparison with sys_exofork() based version).
+ * Remember to fix "thisenv" in the child process.
  */
 envid_t
 fork(void) {
     // LAB 9: Your code here
+    envid_t envid = sys_fork();
+    if (!envid)
+        thisenv = &envs[ENVX(sys_getenvid())];
+
+    return envid;
+}
+
+/* Like fork(), but the child gets light address space described
+ * by page tables alone. Forks of light environments share page tables
+ * with their parents until either side modifies them.
+ * Light mode can only be enabled while the address space is empty,
+ * so the child is built with sys_exofork() */
+envid_t
+lfork(void) {
     envid_t envid = sys_exofork();
     if (envid < 0)
         return envid;
@@ -26,11 +40,14 @@ fork(void) {
         return 0;
     }
 
-    if (sys_map_region(0, NULL, envid, NULL, MAX_USER_ADDRESS, PROT_ALL | PROT_LAZY | PROT_COMBINE)
-        || sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall)
-        || sys_env_set_status(envid, ENV_RUNNABLE))
-        return -1;
-
+    int res;
+    if ((res = sys_set_space_light(envid, 1)) < 0 ||
+        (res = sys_map_region(0, NULL, envid, NULL, MAX_USER_ADDRESS, PROT_ALL | PROT_LAZY | PROT_COMBINE)) < 0 ||
+        (res = sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall)) < 0 ||
+        (res = sys_env_set_status(envid, ENV_RUNNABLE)) < 0) {
+        sys_env_destroy(envid);
+        return res;
+    }
     return envid;
 }
 
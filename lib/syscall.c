@@ -124,6 +124,33 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall) {
     return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uintptr_t)upcall, 0, 0, 0, 0);
 }
 
+int
+sys_set_mempolicy(envid_t envid, int policy) {
+    return syscall(SYS_set_mempolicy, 1, envid, policy, 0, 0, 0, 0);
+}
+
+int
+sys_set_fault_around(envid_t envid, int order) {
+    return syscall(SYS_set_fault_around, 1, envid, order, 0, 0, 0, 0);
+}
+
+int
+sys_set_space_light(envid_t envid, bool light) {
+    return syscall(SYS_set_space_light, 1, envid, light, 0, 0, 0, 0);
+}
+
+/* Unlike sys_exofork() this needs no inlining: the address space
+ * is copied inside the call, so the child returns from it as well */
+envid_t
+sys_fork(void) {
+    return syscall(SYS_fork, 0, 0, 0, 0, 0, 0, 0);
+}
+
+envid_t
+sys_spawn(const char *name, const char **argv) {
+    return syscall(SYS_spawn, 0, (uintptr_t)name, (uintptr_t)argv, 0, 0, 0, 0);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uintptr_t value, void *srcva, size_t size, int perm) {
     return syscall(SYS_ipc_try_send, 0, envid, value, (uintptr_t)srcva, size, perm, 0);
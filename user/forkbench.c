@@ -0,0 +1,120 @@
+/* Measure fork cost of sys_fork() against fork built of
+ * sys_exofork(), sys_map_region(), sys_env_set_pgfault_upcall()
+ * and sys_env_set_status() calls, as lib/fork.c used to do,
+ * against lfork(), which copies mappings into light address space,
+ * and against sys_fork() of light copy made by lfork(),
+ * which shares page tables instead of copying mappings.
+ * Results are in forks per second if TSC frequency is reported by CPUID,
+ * otherwise in TSC cycles per fork, and "timer_cpu_frequency" monitor
+ * command can be used to convert them. Whole fork-heavy workloads like
+ * user/forktree and user/stresssched can be measured with
+ * "timer_start"/"timer_stop" monitor commands. */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define BENCH_ROUNDS 16
+#define BENCH_FORKS  32
+#define BENCH_PAGES  256
+
+static envid_t
+exofork_fork(void) {
+    envid_t envid = sys_exofork();
+    if (envid < 0)
+        return envid;
+    if (!envid) {
+        thisenv = &envs[ENVX(sys_getenvid())];
+        return 0;
+    }
+
+    if (sys_map_region(0, NULL, envid, NULL, MAX_USER_ADDRESS, PROT_ALL | PROT_LAZY | PROT_COMBINE) ||
+        sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall) ||
+        sys_env_set_status(envid, ENV_RUNNABLE))
+        return -1;
+
+    return envid;
+}
+
+/* Returns TSC frequency reported by CPUID or 0 if it is unknown */
+static uint64_t
+tsc_frequency(void) {
+    uint32_t max, den, num, crystal, mhz;
+    cpuid(0, &max, NULL, NULL, NULL);
+    if (max >= 0x15) {
+        cpuid(0x15, &den, &num, &crystal, NULL);
+        if (den && num && crystal) return (uint64_t)crystal * num / den;
+    }
+    if (max >= 0x16) {
+        cpuid(0x16, &mhz, NULL, NULL, NULL);
+        if (mhz) return (uint64_t)mhz * 1000000;
+    }
+    return 0;
+}
+
+static void
+wait_env(envid_t envid) {
+    while (envs[ENVX(envid)].env_id == envid &&
+           envs[ENVX(envid)].env_status != ENV_FREE)
+        sys_yield();
+}
+
+/* Returns average number of cycles spent in fork_fn */
+static uint64_t
+bench(const char *name, envid_t (*fork_fn)(void)) {
+    uint64_t total = 0;
+    envid_t children[BENCH_FORKS];
+
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        for (int j = 0; j < BENCH_FORKS; j++) {
+            uint64_t start = read_tsc();
+            envid_t envid = fork_fn();
+            if (!envid) exit();
+            total += read_tsc() - start;
+
+            if (envid < 0) panic("%s: %i", name, envid);
+            children[j] = envid;
+        }
+
+        /* Wait for children to exit to keep environments available */
+        for (int j = 0; j < BENCH_FORKS; j++)
+            wait_env(children[j]);
+    }
+
+    uint64_t res = total / (BENCH_ROUNDS * BENCH_FORKS);
+    uint64_t freq = tsc_frequency();
+    if (freq)
+        cprintf("forkbench: %s: %lu forks/s (%lu cycles per fork)\n", name,
+                (unsigned long)(freq / (res ? res : 1)), (unsigned long)res);
+    else
+        cprintf("forkbench: %s: %lu cycles per fork\n", name, (unsigned long)res);
+    return res;
+}
+
+void
+umain(int argc, char **argv) {
+    /* Give parent some resident memory so that fork cost
+     * depending on address space size is visible */
+    static uint8_t buf[BENCH_PAGES * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+    for (size_t i = 0; i < sizeof(buf); i += PAGE_SIZE) buf[i] = 1;
+
+    uint64_t slow = bench("sys_exofork", exofork_fork);
+    uint64_t fast = bench("sys_fork", fork);
+    cprintf("forkbench: sys_fork is %lu%% of sys_exofork based fork\n",
+            (unsigned long)(fast * 100 / (slow ? slow : 1)));
+    uint64_t copy = bench("lfork", lfork);
+    cprintf("forkbench: lfork is %lu%% of sys_fork\n",
+            (unsigned long)(copy * 100 / (fast ? fast : 1)));
+
+    envid_t envid = lfork();
+    if (envid < 0) panic("lfork: %i", envid);
+    if (!envid) {
+        /* Light copy gets its own copies of resident pages first */
+        for (size_t i = 0; i < sizeof(buf); i += PAGE_SIZE) buf[i] = 1;
+
+        uint64_t light = bench("sys_fork of light space", fork);
+        cprintf("forkbench: sys_fork of light space is %lu%% of sys_fork\n",
+                (unsigned long)(light * 100 / (fast ? fast : 1)));
+        return;
+    }
+    wait_env(envid);
+}
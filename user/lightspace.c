@@ -0,0 +1,90 @@
+/* Test light address spaces (described by page tables alone).
+ * A light copy of this program maps memory, forks (children of light
+ * environments share its page tables), checks copy-on-write in both
+ * directions and unmaps single pages from the middle of bigger mappings. */
+
+#include <inc/lib.h>
+
+#define LIGHT_BASE  0x1000000000ULL
+#define LIGHT_SIZE  HUGE_PAGE_SIZE
+#define LIGHT_PAGES (LIGHT_SIZE / PAGE_SIZE)
+
+static volatile uint64_t *
+light_page(size_t i) {
+    return (volatile uint64_t *)(LIGHT_BASE + i * PAGE_SIZE);
+}
+
+static void
+wait_env(envid_t envid) {
+    while (envs[ENVX(envid)].env_id == envid &&
+           envs[ENVX(envid)].env_status != ENV_FREE)
+        sys_yield();
+}
+
+static void
+test_light(void) {
+    int res;
+
+    /* Map: lazily zero-filled huge mapping, filled page by page */
+    if ((res = sys_alloc_region(0, (void *)LIGHT_BASE, LIGHT_SIZE, PROT_RW)) < 0)
+        panic("sys_alloc_region: %i", res);
+    for (size_t i = 0; i < LIGHT_PAGES; i++) {
+        if (*light_page(i)) panic("page %zu is not zero-filled", i);
+        *light_page(i) = i + 1;
+    }
+
+    /* Fork: writes of either side are not visible to the other one */
+    envid_t child = fork();
+    if (child < 0) panic("fork: %i", child);
+    if (!child) {
+        for (size_t i = 0; i < LIGHT_PAGES; i++) {
+            if (*light_page(i) != i + 1) panic("child sees %lx at page %zu", (unsigned long)*light_page(i), i);
+            *light_page(i) = 0;
+        }
+        exit();
+    }
+    *light_page(0) = ~0ULL;
+    wait_env(child);
+
+    if (*light_page(0) != ~0ULL) panic("parent write is lost");
+    for (size_t i = 1; i < LIGHT_PAGES; i++)
+        if (*light_page(i) != i + 1) panic("parent sees %lx at page %zu", (unsigned long)*light_page(i), i);
+
+    /* Partial unmap: single page is removed from the middle of
+     * untouched huge mapping, which is split around it */
+    uintptr_t lazy = LIGHT_BASE + LIGHT_SIZE;
+    if ((res = sys_alloc_region(0, (void *)lazy, LIGHT_SIZE, PROT_RW)) < 0)
+        panic("sys_alloc_region: %i", res);
+    size_t hole = LIGHT_PAGES + LIGHT_PAGES / 2;
+    if ((res = sys_unmap_region(0, (void *)light_page(hole), PAGE_SIZE)) < 0)
+        panic("sys_unmap_region: %i", res);
+    if (sys_region_refs((void *)light_page(hole), PAGE_SIZE))
+        panic("unmapped page is still mapped");
+    if (!sys_region_refs((void *)light_page(hole - 1), PAGE_SIZE) ||
+        !sys_region_refs((void *)light_page(hole + 1), PAGE_SIZE))
+        panic("neighbours of unmapped page are unmapped");
+    if (*light_page(hole - 1) || *light_page(hole + 1))
+        panic("neighbours of unmapped page are not zero-filled");
+
+    /* Same for the page with its own copy */
+    hole = LIGHT_PAGES / 2;
+    if ((res = sys_unmap_region(0, (void *)light_page(hole), PAGE_SIZE)) < 0)
+        panic("sys_unmap_region: %i", res);
+    if (sys_region_refs((void *)light_page(hole), PAGE_SIZE))
+        panic("unmapped page is still mapped");
+    if (*light_page(hole - 1) != hole || *light_page(hole + 1) != hole + 2)
+        panic("neighbours of unmapped page are changed");
+
+    cprintf("lightspace: OK\n");
+}
+
+void
+umain(int argc, char **argv) {
+    envid_t envid = lfork();
+    if (envid < 0) panic("lfork: %i", envid);
+    if (!envid) {
+        test_light();
+        return;
+    }
+    wait_env(envid);
+}
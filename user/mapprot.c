@@ -0,0 +1,37 @@
+/* Test that lazy copies cannot enable protection of the source mapping
+ * they do not actually copy: shared pages stay shared and program
+ * text, which is shared by all environments running the program,
+ * is only ever copied. */
+
+#include <inc/lib.h>
+
+#define MAPPROT_BASE 0x1000000000ULL
+
+void
+umain(int argc, char **argv) {
+    uint8_t *shared = (uint8_t *)MAPPROT_BASE;
+    uint8_t *alias = shared + PAGE_SIZE;
+    uint8_t *copy = alias + PAGE_SIZE;
+    int res;
+
+    /* Shared read-only page cannot get writable alias */
+    if ((res = sys_alloc_region(0, shared, PAGE_SIZE, PROT_R | PROT_SHARE)) < 0)
+        panic("sys_alloc_region: %i", res);
+    if ((res = sys_map_region(0, shared, 0, alias, PAGE_SIZE, PROT_RW | PROT_LAZY)) != -E_INVAL)
+        panic("writable lazy alias of shared read-only page: %i", res);
+    if ((res = sys_map_region(0, shared, 0, alias, PAGE_SIZE, PROT_R | PROT_LAZY)) < 0)
+        panic("read-only lazy alias of shared page: %i", res);
+
+    /* Program text can only be copied */
+    uint8_t *text = ROUNDDOWN((uint8_t *)umain, PAGE_SIZE);
+    if ((res = sys_map_region(0, text, 0, copy, PAGE_SIZE, PROT_RW)) != -E_INVAL)
+        panic("writable alias of program text: %i", res);
+    if ((res = sys_map_region(0, text, 0, copy, PAGE_SIZE, PROT_RW | PROT_LAZY)) < 0)
+        panic("writable copy of program text: %i", res);
+    uint8_t old = *text;
+    copy[0] = ~old;
+    if (*text != old)
+        panic("write to copy of program text changed the text");
+
+    cprintf("mapprot: OK\n");
+}
@@ -0,0 +1,34 @@
+/* Map a lot of small regions scattered over a large part of the address space.
+ * Every mapping needs its own path in the virtual memory tree,
+ * so this stresses page descriptor footprint.
+ * Use "memstat" monitor command after it exits to see peak metadata usage
+ * (run user/forktree the same way to measure fork-heavy workloads). */
+
+#include <inc/lib.h>
+
+#define SPARSE_BASE  0x1000000000ULL
+#define SPARSE_STEP  (64 * 1024 * 1024ULL)
+#define SPARSE_COUNT 4096
+
+void
+umain(int argc, char **argv) {
+    int r;
+
+    for (size_t i = 0; i < SPARSE_COUNT; i++) {
+        uintptr_t va = SPARSE_BASE + i * SPARSE_STEP + (i % 512) * PAGE_SIZE;
+        if ((r = sys_alloc_region(0, (void *)va, PAGE_SIZE, PROT_RW)) < 0)
+            panic("sys_alloc_region: %i", r);
+    }
+
+    /* Touch every other page to get real allocations too */
+    for (size_t i = 0; i < SPARSE_COUNT; i += 2) {
+        uintptr_t va = SPARSE_BASE + i * SPARSE_STEP + (i % 512) * PAGE_SIZE;
+        *(volatile uint64_t *)va = i;
+    }
+
+    cprintf("sparsemap: mapped %d pages over %lu GB\n", SPARSE_COUNT,
+            (unsigned long)(SPARSE_COUNT * SPARSE_STEP >> 30));
+
+    if ((r = sys_unmap_region(0, (void *)SPARSE_BASE, SPARSE_COUNT * SPARSE_STEP)) < 0)
+        panic("sys_unmap_region: %i", r);
+}
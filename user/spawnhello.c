@@ -0,0 +1,24 @@
+/* Start copies of this program with sys_spawn() and print their arguments */
+#include <inc/lib.h>
+
+#define SPAWN_DEPTH 2
+
+void
+umain(int argc, char **argv) {
+    cprintf("i am environment %08x, argc %d:", thisenv->env_id, argc);
+    for (int i = 0; i < argc; i++)
+        cprintf(" '%s'", argv[i]);
+    cprintf("\n");
+
+    if (argc > SPAWN_DEPTH) return;
+
+    const char *args[SPAWN_DEPTH + 2];
+    for (int i = 0; i < argc; i++)
+        args[i] = argv[i];
+    args[argc] = argc ? "child" : "spawnhello";
+    args[argc + 1] = NULL;
+
+    envid_t envid = sys_spawn("user/spawnhello", args);
+    if (envid < 0) panic("sys_spawn: %i", envid);
+    cprintf("spawned %08x\n", envid);
+}
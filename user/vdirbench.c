@@ -0,0 +1,65 @@
+/* Measure virtual tree lookups in sparse address space: remapping
+ * of random pages scattered over 64GB, where every lookup leaves the
+ * block of the previous one, and forks copying the whole space.
+ * Build kernel with "make NORADIX=1" to compare radix index with plain
+ * binary tree. Results are in TSC cycles, "memstat" monitor command
+ * shows the number of visited virtual tree nodes */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define VDIR_BASE    0x1000000000ULL
+#define VDIR_STEP    (16 * 1024 * 1024ULL)
+#define VDIR_COUNT   4096
+#define VDIR_REMAPS  65536
+#define VDIR_FORKS   64
+
+static uintptr_t
+vdir_page(size_t i) {
+    return VDIR_BASE + i * VDIR_STEP + (i % 512) * PAGE_SIZE;
+}
+
+static void
+wait_env(envid_t envid) {
+    while (envs[ENVX(envid)].env_id == envid &&
+           envs[ENVX(envid)].env_status != ENV_FREE)
+        sys_yield();
+}
+
+void
+umain(int argc, char **argv) {
+    int res;
+
+    for (size_t i = 0; i < VDIR_COUNT; i++) {
+        if ((res = sys_alloc_region(0, (void *)vdir_page(i), PAGE_SIZE, PROT_RW)) < 0)
+            panic("sys_alloc_region: %i", res);
+        *(volatile uint64_t *)vdir_page(i) = i;
+    }
+
+    /* Random pages are remapped as lazy copies of each other */
+    uint64_t seed = 1;
+    uint64_t start = read_tsc();
+    for (size_t i = 0; i < VDIR_REMAPS; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        size_t src = (seed >> 33) % VDIR_COUNT, dst = (seed >> 17) % VDIR_COUNT;
+        if (src == dst) continue;
+        if ((res = sys_map_region(0, (void *)vdir_page(src), 0, (void *)vdir_page(dst),
+                                  PAGE_SIZE, PROT_RW | PROT_LAZY)) < 0)
+            panic("sys_map_region: %i", res);
+    }
+    uint64_t remap = (read_tsc() - start) / VDIR_REMAPS;
+    cprintf("vdirbench: %lu cycles per remap of random page\n", (unsigned long)remap);
+
+    start = read_tsc();
+    for (size_t i = 0; i < VDIR_FORKS; i++) {
+        envid_t envid = fork();
+        if (envid < 0) panic("fork: %i", envid);
+        if (!envid) exit();
+        wait_env(envid);
+    }
+    uint64_t fork_cycles = (read_tsc() - start) / VDIR_FORKS;
+    cprintf("vdirbench: %lu cycles per fork and exit of child\n", (unsigned long)fork_cycles);
+
+    if ((res = sys_unmap_region(0, (void *)VDIR_BASE, VDIR_COUNT * VDIR_STEP)) < 0)
+        panic("sys_unmap_region: %i", res);
+}